@@ -0,0 +1,169 @@
+#ifndef SIMHASH_CLUSTERING_H
+#define SIMHASH_CLUSTERING_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+/**
+ * The algorithm used to turn matches into clusters.
+ *
+ * - `union_find` merges matches into a concurrent union-find forest as they
+ *   are verified, never storing them
+ * - `components` collects the matches as a compact edge list and finds its
+ *   connected components in parallel
+ * - `leader` assigns every hash to the first leader within the distance, so
+ *   clusters do not chain (see `find_leaders`)
+ */
+enum class ClusterEngine { union_find, components, leader };
+
+/**
+ * Parse a clustering engine from its name, throwing std::invalid_argument for
+ * an unknown name.
+ */
+ClusterEngine parse_cluster_engine(const std::string &name);
+
+/**
+ * Find all the clusters within the sorted, distinct `hashes` with `engine`.
+ * Clusters are numbered in order of their smallest member.
+ */
+index_clusters_t find_clusters(const std::vector<hash_t> &hashes,
+                               size_t number_of_blocks, size_t different_bits,
+                               ClusterEngine engine,
+                               ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find the connected components with at least two members of the graph over
+ * `size` nodes with the given edges, in parallel.
+ *
+ * This is Shiloach-Vishkin style label propagation: every round hooks the
+ * larger of the two roots of each edge onto the smaller, then shortcuts
+ * every label to its root, and drops the edges that now lie within a single
+ * tree, until no edge joins two trees. The edges are consumed.
+ */
+index_clusters_t find_components(size_t size,
+                                 std::vector<index_match_t> edges);
+
+/**
+ * Find star-shaped clusters within the sorted, distinct `hashes`.
+ *
+ * Hashes are visited in ascending order. Each one joins the earliest leader
+ * within `different_bits` of it, found with an index query over the leaders
+ * so far; if there is none, it becomes a leader itself. Every member is thus
+ * within `different_bits` of its leader, which bounds the diameter of a
+ * cluster, and only the leaders are indexed, so no matches are stored.
+ *
+ * Leaders are the smallest member of their cluster, and clusters with at
+ * least two members are numbered in order of their leader.
+ */
+index_clusters_t find_leaders(const std::vector<hash_t> &hashes,
+                              size_t number_of_blocks, size_t different_bits,
+                              ProgressMode progress = ProgressMode::bar);
+
+/**
+ * How the representative of a cluster is chosen.
+ *
+ * - `medoid` picks the member with the smallest total Hamming distance to the
+ *   other members
+ * - `most_ids` picks the member shared by the most records
+ *
+ * Ties go to the smallest member.
+ */
+enum class Representative { medoid, most_ids };
+
+/**
+ * Parse a representative mode from its name, throwing std::invalid_argument
+ * for an unknown name.
+ */
+Representative parse_representative(const std::string &name);
+
+/**
+ * Clusters with more members than this have their medoid estimated against
+ * an evenly spaced sample of this many members instead of all of them.
+ */
+static const size_t MEDOID_SAMPLE = 1 << 10;
+
+/**
+ * Choose one representative per cluster, in parallel, returning the index
+ * into `hashes` of each.
+ *
+ * The records of index `i` are `offsets[i]..offsets[i + 1]`, as used by
+ * `most_ids`; `medoid` only needs the hashes.
+ */
+std::vector<index_t> find_representatives(const index_clusters_t &clusters,
+                                          const std::vector<hash_t> &hashes,
+                                          const std::vector<uint64_t> &offsets,
+                                          Representative mode);
+
+/**
+ * Cluster assignments that persist across runs.
+ *
+ * Holds every hash seen so far, in ascending order, with the stable id of
+ * its cluster, or `NO_CLUSTER` if it has not matched anything yet. New
+ * batches are clustered against it with `update_clusters`.
+ */
+struct ClusterState {
+  static const uint64_t NO_CLUSTER = UINT64_MAX;
+
+  std::vector<hash_t> hashes;
+  std::vector<uint64_t> clusters;
+
+  /**
+   * The id the next new cluster will get.
+   */
+  uint64_t next_cluster = 0;
+
+  /**
+   * The parameters the clusters were built with, zero for a new state.
+   */
+  size_t number_of_blocks = 0;
+  size_t different_bits = 0;
+
+  /**
+   * Read a state written by `save`, throwing std::runtime_error if the file
+   * cannot be read or is invalid: the hashes must be sorted and distinct,
+   * and every cluster id below `next_cluster`.
+   */
+  static ClusterState load(const std::string &path);
+
+  /**
+   * Write the state to `path`, throwing std::runtime_error on failure.
+   *
+   * The file is a header (magic, version, byte order, number of blocks,
+   * distance, number of hashes and next cluster id) followed by the hashes
+   * and their cluster ids as fixed-width arrays.
+   */
+  void save(const std::string &path) const;
+
+  /**
+   * The clusters of the sorted, distinct `hashes`, all of which must be in
+   * the state, by index into `hashes`. The stable id of each cluster is
+   * appended to `ids`; clusters are in order of their id.
+   */
+  index_clusters_t clusters_of(const std::vector<hash_t> &hashes,
+                               std::vector<uint64_t> &ids) const;
+};
+
+/**
+ * Cluster the sorted, distinct `batch` against `state`, adding its hashes.
+ *
+ * Only the new edges are computed: those among the hashes not yet in the
+ * state, and those between them and the hashes already in it. Existing
+ * clusters are seeded into a union-find forest and merged only where new
+ * edges join them. A merged cluster keeps the smallest id among those it
+ * joins, and clusters made only of new hashes get new ids, so ids are stable
+ * across runs. Throws std::invalid_argument if the state was built with
+ * other parameters.
+ */
+void update_clusters(ClusterState &state, const std::vector<hash_t> &batch,
+                     size_t number_of_blocks, size_t different_bits,
+                     ProgressMode progress = ProgressMode::bar);
+
+} // namespace Simhash
+
+#endif // SIMHASH_CLUSTERING_H
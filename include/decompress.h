@@ -0,0 +1,74 @@
+#ifndef SIMHASH_DECOMPRESS_H
+#define SIMHASH_DECOMPRESS_H
+
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <string>
+
+namespace Simhash {
+
+/**
+ * The compression of an input file.
+ *
+ * - `gzip` is read with zlib, and may have several members, as written by
+ *   pigz or bgzip
+ * - `zstd` is only available if zstd was found at build time
+ */
+enum class Compression { none, gzip, zstd };
+
+/**
+ * Detect the compression of the file at `path` from its magic bytes,
+ * throwing std::runtime_error if it cannot be read.
+ */
+Compression detect_compression(const std::string &path);
+
+/**
+ * Whether this build can decode `compression`.
+ */
+bool compression_supported(Compression compression);
+
+/**
+ * Decompressed input is handed over in buffers of this many bytes.
+ */
+static const size_t DECODE_CHUNK = 1 << 22;
+
+/**
+ * The number of decompressed buffers in flight, so decoding can run this
+ * far ahead of the reader.
+ */
+static const size_t DECODE_RING = 4;
+
+/**
+ * An input stream over a compressed file.
+ *
+ * The file is decoded on a dedicated thread into a ring of large buffers,
+ * which the stream hands out in order as they are read, so decompression
+ * overlaps with parsing. Errors while decoding end the stream early and are
+ * reported by `check`.
+ */
+class DecompressedStream : public std::istream {
+public:
+  /**
+   * Open `path`, throwing std::runtime_error if it cannot be read or its
+   * compression is not supported.
+   */
+  DecompressedStream(const std::string &path, Compression compression);
+  ~DecompressedStream();
+
+  DecompressedStream(const DecompressedStream &) = delete;
+  DecompressedStream &operator=(const DecompressedStream &) = delete;
+
+  /**
+   * Throw std::runtime_error if decoding failed.
+   */
+  void check() const;
+
+private:
+  class Buffer;
+  std::unique_ptr<Buffer> buffer_;
+};
+
+} // namespace Simhash
+
+#endif // SIMHASH_DECOMPRESS_H
@@ -0,0 +1,66 @@
+#ifndef SIMHASH_GRAPH_H
+#define SIMHASH_GRAPH_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+/**
+ * The near-duplicate graph over dense indices, in compressed sparse row form.
+ *
+ * Every match is an undirected edge, stored in both directions: the
+ * neighbors of index `i` are `neighbors[offsets[i]]` up to (not including)
+ * `neighbors[offsets[i + 1]]`, in ascending order.
+ */
+struct Graph {
+  std::vector<uint64_t> offsets;
+  std::vector<index_t> neighbors;
+
+  /**
+   * Build the graph over `size` nodes from a list of edges.
+   */
+  static Graph build(size_t size, const std::vector<index_match_t> &edges);
+
+  /**
+   * The number of nodes.
+   */
+  size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+  /**
+   * The number of undirected edges.
+   */
+  size_t edges() const { return neighbors.size() / 2; }
+
+  /**
+   * Write the graph to `path`, with `hashes` giving the hash of every node.
+   * Throws std::runtime_error on failure.
+   *
+   * The file is a header (magic, version, byte order, node and neighbor
+   * counts) followed by the hashes, the offsets and the neighbors as
+   * fixed-width arrays.
+   */
+  void save(const std::string &path, const std::vector<hash_t> &hashes) const;
+};
+
+/**
+ * Find all the matches within the sorted, distinct `hashes` and build the
+ * graph of them.
+ */
+Graph find_graph(const std::vector<hash_t> &hashes, size_t number_of_blocks,
+                 size_t different_bits,
+                 ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find the clusters of a graph, its connected components with at least two
+ * members, numbered in order of their smallest member.
+ */
+index_clusters_t find_clusters(const Graph &graph);
+
+} // namespace Simhash
+
+#endif // SIMHASH_GRAPH_H
@@ -0,0 +1,89 @@
+#ifndef SIMHASH_IDS_H
+#define SIMHASH_IDS_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace Simhash {
+
+/**
+ * Append the decimal form of `value` to `out`, without any temporaries.
+ */
+void append_decimal(std::string &out, uint64_t value);
+void append_decimal(std::string &out, int64_t value);
+
+/**
+ * A compact table of record ids.
+ *
+ * Every id takes a single 8-byte slot and a byte for its kind. Ids that are
+ * plain decimal integers in the range of a uint64_t or an int64_t are stored
+ * in the slot itself, and formatted again when written; any other id is
+ * interned in a shared arena, prefixed with its length, and its slot holds
+ * its offset there. Ids read back exactly as they were added.
+ */
+class IdTable {
+public:
+  /**
+   * Add the id [begin, end).
+   */
+  void push_back(const char *begin, const char *end);
+
+  /**
+   * Add the integer id `value`, stored as if its decimal form were added.
+   */
+  void push_back(uint64_t value);
+
+  void reserve(size_t size);
+  size_t size() const;
+
+  /**
+   * Whether id `i` is stored as an integer, and if so whether it is
+   * negative, and its bits: a uint64_t, or an int64_t if negative.
+   */
+  bool is_integer(size_t i) const;
+  bool is_negative(size_t i) const;
+  uint64_t integer(size_t i) const;
+
+  /**
+   * The text of the interned id `i`, which must not be an integer. The
+   * pointer stays valid until the next id is added.
+   */
+  const char *text(size_t i, size_t &size) const;
+
+  /**
+   * Append the text of id `i` to `out`.
+   */
+  void append_to(std::string &out, size_t i) const;
+
+  /**
+   * Add the first `count` ids of `other`.
+   */
+  void append(const IdTable &other, size_t count);
+
+  /**
+   * Reorder the ids so that id `k` becomes the previous id `order[k]`. The
+   * arena is left as it is, only the slots move.
+   */
+  void permute(const std::vector<uint64_t> &order);
+
+  /**
+   * Drop the repeats of an id within each of the ranges
+   * [offsets[i], offsets[i + 1]), keeping the first of each in place, and
+   * move the offsets to match.
+   */
+  void deduplicate(std::vector<uint64_t> &offsets);
+
+private:
+  // The kinds of slot: an integer with either sign, or an arena offset
+  enum : uint8_t { UNSIGNED, NEGATIVE, TEXT };
+
+  std::vector<uint64_t> slots_;
+  std::vector<uint8_t> kinds_;
+  std::string arena_;
+};
+
+} // namespace Simhash
+
+#endif // SIMHASH_IDS_H
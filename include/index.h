@@ -0,0 +1,127 @@
+#ifndef SIMHASH_INDEX_H
+#define SIMHASH_INDEX_H
+
+#include <cstddef>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+/**
+ * A persistent near-duplicate index.
+ *
+ * The index holds one sorted table of permuted hashes for every permutation
+ * needed to find matches within `different_bits` bits (see `Architecture` in
+ * the README). A query applies each permutation to the query hash, binary
+ * searches for the range of entries sharing its prefix, and compares only
+ * the entries in that range.
+ *
+ * Every stored hash has an id. Hashes the index was built from get their
+ * position in the input vector, so callers can keep their own records in a
+ * parallel vector, and inserted hashes get the following ids in order.
+ *
+ * An index can be saved to a file and opened again with `open`, which maps
+ * the file into memory and uses the tables in place.
+ *
+ * Inserts are organized like a log-structured merge tree: they go to a small
+ * sorted buffer per permutation, which is frozen into an immutable sorted run
+ * once full. A background thread merges runs of similar size (tiered
+ * compaction) so that queries, which consult every run, stay cheap. `insert`
+ * and the queries may be called concurrently.
+ */
+class Index {
+public:
+  /**
+   * Build an index over `hashes`, to find matches differing by at most
+   * `different_bits` bits using `number_of_blocks` blocks.
+   */
+  Index(const std::vector<hash_t> &hashes, size_t number_of_blocks,
+        size_t different_bits);
+
+  ~Index();
+  Index(Index &&);
+  Index &operator=(Index &&);
+  Index(const Index &) = delete;
+  Index &operator=(const Index &) = delete;
+
+  /**
+   * Open an index file written by `save`. The file is memory mapped and used
+   * without deserialization; it must not be modified while it is open.
+   *
+   * Throws std::runtime_error if the file cannot be read or is not a valid
+   * index file.
+   */
+  static Index open(const std::string &path);
+
+  /**
+   * Write this index to `path`, throwing std::runtime_error on failure. All
+   * runs are merged into one in the written file.
+   *
+   * The file starts with a versioned header holding the number of blocks,
+   * the maximum distance and the masks of every permutation, followed by the
+   * stored hashes, their ids and each sorted permuted table, every section
+   * aligned to a page boundary.
+   */
+  void save(const std::string &path) const;
+
+  /**
+   * Insert `hash`, returning its id.
+   */
+  uint64_t insert(hash_t hash);
+
+  /**
+   * Freeze the insert buffer into an immutable run, even if it is not full.
+   */
+  void flush();
+
+  /**
+   * Find the distinct stored hashes within `different_bits` of `query`, in
+   * ascending order.
+   */
+  std::vector<hash_t> find(hash_t query) const;
+
+  /**
+   * Find the ids of all stored hashes within `different_bits` of `query`, in
+   * ascending order.
+   */
+  std::vector<uint64_t> find_ids(hash_t query) const;
+
+  /**
+   * Find all the matches between the hashes in `batch` and the stored
+   * hashes, ordered as (hash from `batch`, stored hash).
+   *
+   * For each permutation the batch is permuted and sorted once, then
+   * merge-joined against the prebuilt table of every run.
+   */
+  matches_t find_between(const std::unordered_set<hash_t> &batch,
+                         ProgressMode progress = ProgressMode::bar) const;
+
+  /**
+   * The number of hashes stored, including repeats.
+   */
+  size_t size() const;
+
+  /**
+   * The number of immutable runs, not counting the insert buffer.
+   */
+  size_t runs() const;
+
+  size_t number_of_blocks() const;
+  size_t different_bits() const;
+
+private:
+  struct State;
+
+  explicit Index(std::unique_ptr<State> state);
+
+  std::unique_ptr<State> state_;
+};
+
+} // namespace Simhash
+
+#endif // SIMHASH_INDEX_H
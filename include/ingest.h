@@ -0,0 +1,106 @@
+#ifndef SIMHASH_INGEST_H
+#define SIMHASH_INGEST_H
+
+#include <cstddef>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "ids.h"
+#include "simhash.h"
+
+namespace Simhash {
+
+/**
+ * The format of the input records.
+ *
+ * - `hash` is a tsv of ids and decimal hashes, with a header line
+ * - `json` is one JSON object per line, whose text is fingerprinted
+ * - `binary` is a fingerprint file written by `write_fingerprints`
+ */
+enum class InputFormat { hash, json, binary };
+
+/**
+ * Parse an input format from its name, throwing std::invalid_argument for an
+ * unknown name.
+ */
+InputFormat parse_input_format(const std::string &name);
+
+/**
+ * How to read the input records.
+ */
+struct ReadOptions {
+  InputFormat format = InputFormat::hash;
+
+  /**
+   * The fields holding the text and the id of a `json` record. The id may be
+   * any JSON string or number.
+   */
+  std::string text_column;
+  std::string id_column;
+
+  /**
+   * Only read the first `sample` records, if larger than zero.
+   */
+  size_t sample = 0;
+
+  /**
+   * The number of bytes in each shingle of a `json` text, 5 if zero.
+   */
+  size_t window = 0;
+};
+
+/**
+ * The input is read in newline-aligned chunks of about this many bytes,
+ * which are the unit of work of the parsing threads.
+ */
+static const size_t INGEST_CHUNK = 1 << 22;
+
+/**
+ * Read the records of `stream`, appending the hash of every record to
+ * `records` and its id to `ids`, in input order. Returns the number of lines
+ * read, not counting a header.
+ *
+ * Reading is pipelined: while a batch of chunks is parsed and fingerprinted
+ * in parallel, each into its own buffers, a separate thread reads the next
+ * batch, and the buffers are then appended in order. Empty lines are
+ * skipped. Errors in a record are rethrown once the batch is done.
+ *
+ * The `binary` format cannot be streamed, and throws std::invalid_argument.
+ */
+size_t read_records(std::istream &stream, const ReadOptions &options,
+                    std::vector<hash_t> &records,
+                    IdTable &ids);
+
+/**
+ * Read the records of the file at `path` like the stream overload, but
+ * without copying: the file is memory mapped for sequential access, cut
+ * into chunks at line boundaries, and the chunks are parsed in place, a
+ * batch at a time. Files that cannot be mapped, like pipes, are streamed.
+ * Gzip and zstd files are recognised by their magic bytes and streamed
+ * through a DecompressedStream, so decoding runs alongside parsing. Throws
+ * std::runtime_error if the file cannot be read or decoded.
+ *
+ * This is the only way to read the `binary` format, whose hashes are copied
+ * out of the mapping in one go.
+ */
+size_t read_records(const std::string &path, const ReadOptions &options,
+                    std::vector<hash_t> &records,
+                    IdTable &ids);
+
+/**
+ * Write `records` and their `ids` to `path` as a fingerprint file, throwing
+ * std::runtime_error on failure.
+ *
+ * The file is a header (magic, version, byte order, number of records and
+ * size of the id blob), the hashes as `uint64`, and, unless the blob size is
+ * zero, `records + 1` offsets (`uint64`) into the blob of concatenated ids
+ * that follows them. Records without ids are numbered by position when read.
+ */
+void write_fingerprints(const std::string &path,
+                        const std::vector<hash_t> &records,
+                        const IdTable &ids);
+
+} // namespace Simhash
+
+#endif // SIMHASH_INGEST_H
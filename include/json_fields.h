@@ -0,0 +1,32 @@
+#ifndef SIMHASH_JSON_FIELDS_H
+#define SIMHASH_JSON_FIELDS_H
+
+#include <cstddef>
+#include <string>
+
+namespace Simhash {
+
+/**
+ * Pull a string field and an id field out of one JSON object without
+ * building a document.
+ *
+ * The raw text in [begin, end) is scanned for the top-level keys
+ * `text_key` and `id_key` only; other values are skipped over without being
+ * decoded. The text value is copied into `text`, whose storage is reused
+ * across calls, and escape sequences are only decoded if it has any. The id
+ * may be a string, copied the same way, or an integer, copied as written.
+ *
+ * Returns false, leaving the outputs unspecified, whenever the fast path does
+ * not apply: either key missing or of another type, an id that is not a
+ * string or a plain integer, escaped keys, or malformed input. The
+ * caller should then fall back to a full parser, which also reports errors.
+ * The scan is more lenient than a full parser: it stops once both keys are
+ * found, and does not validate the encoding of the strings it copies.
+ */
+bool extract_fields(const char *begin, const char *end,
+                    const std::string &text_key, const std::string &id_key,
+                    std::string &text, std::string &id);
+
+} // namespace Simhash
+
+#endif // SIMHASH_JSON_FIELDS_H
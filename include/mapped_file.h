@@ -0,0 +1,42 @@
+#ifndef SIMHASH_MAPPED_FILE_H
+#define SIMHASH_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace Simhash {
+
+/**
+ * A read-only memory mapping of a whole file.
+ *
+ * The mapping is shared, so several processes mapping the same file share
+ * one copy of it in the page cache.
+ */
+class MappedFile {
+public:
+  /**
+   * Map the file at `path`, throwing std::runtime_error on failure.
+   */
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const;
+  size_t size() const;
+
+  /**
+   * Hint the expected access pattern of the mapping to the kernel, with one
+   * of the MADV_* constants. Failures are ignored, it is only a hint.
+   */
+  void advise(int advice) const;
+
+private:
+  char *data_;
+  size_t size_;
+};
+
+} // namespace Simhash
+
+#endif // SIMHASH_MAPPED_FILE_H
@@ -0,0 +1,121 @@
+#ifndef SIMHASH_OUTPUT_H
+#define SIMHASH_OUTPUT_H
+
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ids.h"
+#include "simhash.h"
+
+namespace Simhash {
+
+/**
+ * The format of the clusters written out.
+ *
+ * - `tsv` is one line of text per record
+ * - `binary` is one fixed-width array per column, see
+ *   `write_cluster_columns`
+ */
+enum class OutputFormat { tsv, binary };
+
+/**
+ * Parse an output format from its name, throwing std::invalid_argument for
+ * an unknown name.
+ */
+OutputFormat parse_output_format(const std::string &name);
+
+/**
+ * Rows are formatted in blocks of whole clusters with at least this many
+ * rows, each block into its own buffer.
+ */
+static const size_t WRITE_BLOCK = 1 << 14;
+
+/**
+ * Write one tsv row per record of every cluster: its id, its hash and its
+ * cluster.
+ *
+ * The ids of the hash with index `i` are `ids[offsets[i]..offsets[i + 1])`.
+ * Clusters are numbered by position, unless `labels` gives the id of each.
+ * If `representatives` is given, the hash of each cluster's representative
+ * is written as an extra column.
+ *
+ * Blocks of clusters are formatted in parallel, a batch at a time, and the
+ * buffers are written in order with one call each, so the output is the
+ * same as writing the rows one by one. Throws std::runtime_error if the
+ * stream fails.
+ */
+void write_clusters(std::ostream &stream, const index_clusters_t &clusters,
+                    const std::vector<hash_t> &hashes,
+                    const std::vector<uint64_t> &offsets, const IdTable &ids,
+                    const std::vector<uint64_t> &labels,
+                    const std::vector<index_t> &representatives);
+
+/**
+ * Write the same rows as `write_clusters` to `path` in binary columnar form,
+ * throwing std::runtime_error on failure.
+ *
+ * The file is a header (magic, version, byte order, number of rows, number
+ * of clusters, size of the id blob, and whether representatives are
+ * included), followed by one `uint64` array per column: the hashes, the
+ * cluster ids, the representative hashes if included, and `rows + 1`
+ * offsets into the blob of concatenated ids that ends the file. Every array
+ * starts on an 8-byte boundary, so the file can be mapped and read in place.
+ *
+ * Blocks are collected in parallel and each column is written to its place
+ * in the file, so only one batch of blocks is ever held in memory.
+ */
+void write_cluster_columns(const std::string &path,
+                           const index_clusters_t &clusters,
+                           const std::vector<hash_t> &hashes,
+                           const std::vector<uint64_t> &offsets,
+                           const IdTable &ids,
+                           const std::vector<uint64_t> &labels,
+                           const std::vector<index_t> &representatives);
+
+/**
+ * Writes matches to a stream as they are found, as the sink of `find_all`.
+ *
+ * In `tsv` form every match is a line with the two hashes and, optionally,
+ * their distance, after a header line. In `binary` form the stream must be
+ * seekable: a header (magic, version, byte order, whether distances are
+ * included, and the number of matches, filled in by `finish`) is followed by
+ * one record of two or three `uint64` per match.
+ *
+ * Each batch is formatted by the calling thread into its own buffer and
+ * written with a single call under a lock, so matches are in no particular
+ * order.
+ */
+class PairWriter {
+public:
+  PairWriter(std::ostream &stream, OutputFormat format, bool distances);
+
+  /**
+   * Write a batch of matches. Thread safe.
+   */
+  void write(const std::vector<match_t> &matches);
+
+  /**
+   * Complete the output, throwing std::runtime_error if any write failed.
+   */
+  void finish();
+
+  /**
+   * The number of matches written so far.
+   */
+  uint64_t count() const;
+
+private:
+  std::ostream &stream_;
+  OutputFormat format_;
+  bool distances_;
+  std::mutex mutex_;
+  uint64_t count_;
+};
+
+} // namespace Simhash
+
+#endif // SIMHASH_OUTPUT_H
@@ -0,0 +1,92 @@
+#ifndef SIMHASH_PROGRESS_H
+#define SIMHASH_PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Simhash {
+
+/**
+ * How progress is reported while a long running stage is working.
+ *
+ * - `bar` draws a progress bar on stderr, so it never mixes with output
+ *   written to stdout
+ * - `quiet` reports nothing
+ * - `json` writes one JSON object per line to stderr
+ */
+enum class ProgressMode { bar, quiet, json };
+
+/**
+ * Parse a progress mode from its name, throwing std::invalid_argument for an
+ * unknown name.
+ */
+ProgressMode parse_progress_mode(const std::string &name);
+
+/**
+ * A low-frequency progress reporter.
+ *
+ * Workers only bump relaxed atomic counters through `advance`; a separate
+ * thread wakes up periodically, reads the counters, and does all of the
+ * formatting and output, so the hot loops never touch a stream.
+ */
+class Progress {
+public:
+  explicit Progress(ProgressMode mode);
+
+  /**
+   * Stop the reporter thread, terminating the bar line if one was drawn.
+   */
+  ~Progress();
+
+  Progress(const Progress &) = delete;
+  Progress &operator=(const Progress &) = delete;
+
+  /**
+   * Start step `step` of `steps` of the named stage, which will process
+   * `total` units of work.
+   */
+  void begin(const std::string &stage, size_t step, size_t steps,
+             size_t total);
+
+  /**
+   * Record that `count` more units of work are done. Safe to call from any
+   * thread.
+   */
+  void advance(size_t count) {
+    done_.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  /**
+   * Mark the current step as complete and report it immediately.
+   */
+  void end();
+
+private:
+  void run();
+  void report(bool final);
+
+  ProgressMode mode_;
+  std::atomic<size_t> done_;
+  std::atomic<size_t> total_;
+
+  // Guarded by mutex_
+  std::string stage_;
+  size_t step_;
+  size_t steps_;
+  bool drawn_;
+  bool stop_;
+  std::chrono::high_resolution_clock::time_point start_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::thread thread_;
+};
+
+} // namespace Simhash
+
+#endif // SIMHASH_PROGRESS_H
@@ -5,7 +5,9 @@
 #ifndef SIMHASH_SIMHASH_H
 #define SIMHASH_SIMHASH_H
 
+#include <algorithm>
 #include <cstddef>
+#include <functional>
 #include <mutex>
 #include <stdint.h>
 #include <unordered_map>
@@ -13,6 +15,8 @@
 #include <utility>
 #include <vector>
 
+#include "progress.h"
+
 namespace Simhash {
 
 /**
@@ -39,17 +43,79 @@ struct match_t_hash {
  */
 typedef std::unordered_set<match_t, match_t_hash> matches_t;
 
+/**
+ * A consumer of matches, as they are found.
+ *
+ * It is called from the worker threads with batches of matches, so it may be
+ * called concurrently and must be thread safe. The batch is only valid for
+ * the duration of the call.
+ */
+typedef std::function<void(const std::vector<match_t> &)> match_sink_t;
+
 /**
  * The type of a set of clusters.
  */
 typedef std::unordered_set<hash_t> cluster_t;
 typedef std::vector<cluster_t> clusters_t;
 
+/**
+ * The type of a dense index of a hash: its position in the sorted, distinct
+ * hashes of a corpus. Every stage after ingest works with these instead of
+ * hashes, so that lookups are array accesses.
+ */
+typedef uint32_t index_t;
+
+/**
+ * The type of a match of two hashes by their indices, smaller index first.
+ */
+typedef std::pair<index_t, index_t> index_match_t;
+
+/**
+ * A consumer of matches by index. Like match_sink_t, it is called from the
+ * worker threads and must be thread safe.
+ */
+typedef std::function<void(const std::vector<index_match_t> &)> index_sink_t;
+
+/**
+ * A set of clusters by index, in compressed form: the members of cluster `c`
+ * are `members[offsets[c]]` up to (not including) `members[offsets[c + 1]]`.
+ */
+struct index_clusters_t {
+  std::vector<index_t> offsets;
+  std::vector<index_t> members;
+
+  /**
+   * The number of clusters.
+   */
+  size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+};
+
+class UnionFind;
+
 /**
  * The number of bits in a hash_t.
  */
 static const size_t BITS = sizeof(hash_t) * 8;
 
+/**
+ * The number of set bits in `hash`.
+ *
+ * This is a single instruction where the target is known to have one (on
+ * x86-64 only with `-mpopcnt` or `-march`, see `SIMHASH_NATIVE`), and a
+ * branch-free SWAR count otherwise, rather than a call into the compiler
+ * runtime.
+ */
+inline size_t popcount(hash_t hash) {
+#if defined(__POPCNT__) || defined(__aarch64__)
+  return static_cast<size_t>(__builtin_popcountll(hash));
+#else
+  hash = hash - ((hash >> 1) & 0x5555555555555555ULL);
+  hash = (hash & 0x3333333333333333ULL) + ((hash >> 2) & 0x3333333333333333ULL);
+  hash = (hash + (hash >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return static_cast<size_t>((hash * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
 /**
  * Compute the number of bits that are flipped between two numbers
  *
@@ -68,10 +134,71 @@ hash_t compute(const std::vector<hash_t> &hashes);
  * Find the set of all matches within the provided vector of hashes.
  *
  * The provided hashes are manipulated in place, but upon completion are
- * restored to their original state.
+ * restored to their original state. Progress is reported according to
+ * `progress`.
  */
 matches_t find_all(std::unordered_set<hash_t> &hashes, size_t number_of_blocks,
-                   size_t different_bits);
+                   size_t different_bits,
+                   ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find all the matches within the provided hashes like above, but hand them
+ * to `sink` in per-thread batches as they are verified instead of collecting
+ * them. Every match is passed exactly once.
+ */
+void find_all(std::unordered_set<hash_t> &hashes, size_t number_of_blocks,
+              size_t different_bits, const match_sink_t &sink,
+              ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find all the matches within the sorted, distinct `hashes`, handing them to
+ * `sink` as pairs of hashes in per-thread batches as they are verified.
+ */
+void find_all(const std::vector<hash_t> &hashes, size_t number_of_blocks,
+              size_t different_bits, const match_sink_t &sink,
+              ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find all the matches within the sorted, distinct `hashes`, handing them to
+ * `sink` by index in per-thread batches as they are verified. The indices are
+ * sorted along with the permuted hashes, so no hash is ever looked up.
+ */
+void find_all(const std::vector<hash_t> &hashes, size_t number_of_blocks,
+              size_t different_bits, const index_sink_t &sink,
+              ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find all the matches between two sets of hashes, without comparing hashes
+ * within the same set. Each match is ordered as (hash from `first`, hash from
+ * `second`).
+ *
+ * For each permutation, only the smaller set is permuted and sorted as a
+ * whole; the larger set is permuted and sorted in chunks, each merge-joined
+ * against it.
+ */
+matches_t find_between(const std::unordered_set<hash_t> &first,
+                       const std::unordered_set<hash_t> &second,
+                       size_t number_of_blocks, size_t different_bits,
+                       ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find all the matches between two vectors of distinct hashes like above,
+ * but hand them to `sink` in per-thread batches as they are verified. Every
+ * match is passed exactly once. Neither vector is copied.
+ */
+void find_between(const std::vector<hash_t> &first,
+                  const std::vector<hash_t> &second, size_t number_of_blocks,
+                  size_t different_bits, const match_sink_t &sink,
+                  ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find all the matches between two vectors of distinct hashes like above,
+ * handing them to `sink` as (index into `first`, index into `second`).
+ */
+void find_between(const std::vector<hash_t> &first,
+                  const std::vector<hash_t> &second, size_t number_of_blocks,
+                  size_t different_bits, const index_sink_t &sink,
+                  ProgressMode progress = ProgressMode::bar);
 
 /**
  * Find all the clusters of simhashes.
@@ -80,7 +207,47 @@ matches_t find_all(std::unordered_set<hash_t> &hashes, size_t number_of_blocks,
  * cluster already that is within `number_of_blocks` of the hash.
  */
 clusters_t find_clusters(std::unordered_set<hash_t> &hashes,
-                         size_t number_of_blocks, size_t different_bits);
+                         size_t number_of_blocks, size_t different_bits,
+                         ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Find all the clusters within the sorted, distinct `hashes`, by index.
+ * Clusters are numbered in order of their smallest member.
+ */
+index_clusters_t find_clusters(const std::vector<hash_t> &hashes,
+                               size_t number_of_blocks, size_t different_bits,
+                               ProgressMode progress = ProgressMode::bar);
+
+/**
+ * Collect the sets of `forest` with at least two members as clusters,
+ * numbered in order of their smallest member.
+ */
+index_clusters_t make_clusters(UnionFind &forest);
+
+/**
+ * Collect clusters like above, from the root of every index, which must be
+ * the smallest index of its set.
+ */
+index_clusters_t make_clusters(const std::vector<index_t> &roots);
+
+/**
+ * Assign dense indices: fill `hashes` with the sorted, distinct hashes of
+ * `records`, and return the index of every record's hash.
+ *
+ * Throws std::invalid_argument if there are more distinct hashes than
+ * index_t can address.
+ */
+std::vector<index_t> remap(const std::vector<hash_t> &records,
+                           std::vector<hash_t> &hashes);
+
+/**
+ * The index of `hash` within the sorted, distinct `hashes`, which must
+ * contain it.
+ */
+inline index_t index_of(const std::vector<hash_t> &hashes, hash_t hash) {
+  return static_cast<index_t>(
+      std::lower_bound(hashes.begin(), hashes.end(), hash) - hashes.begin());
+}
 
 class Permutation {
 public:
@@ -125,6 +292,11 @@ public:
    * _differing_bits_ blocks set to 1. */
   hash_t search_mask() const;
 
+  /**
+   * The block masks this permutation was constructed from, in permuted order.
+   */
+  const std::vector<hash_t> &masks() const;
+
 private:
   std::vector<hash_t> forward_masks;
   std::vector<hash_t> reverse_masks;
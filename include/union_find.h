@@ -0,0 +1,43 @@
+#ifndef SIMHASH_UNION_FIND_H
+#define SIMHASH_UNION_FIND_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace Simhash {
+
+/**
+ * A lock-free disjoint-set forest over the dense indices [0, size).
+ *
+ * Every element holds a single 4-byte parent index. Roots are linked by
+ * index, the larger root under the smaller, with a compare-and-swap, and
+ * `find` halves paths as it goes, also with compare-and-swaps. Parents only
+ * ever move to smaller indices, so `find` and `unite` may be called
+ * concurrently from any number of threads.
+ */
+class UnionFind {
+public:
+  explicit UnionFind(size_t size);
+
+  /**
+   * The root of the set containing `x`.
+   */
+  uint32_t find(uint32_t x);
+
+  /**
+   * Merge the sets containing `a` and `b`, returning whether they were
+   * distinct.
+   */
+  bool unite(uint32_t a, uint32_t b);
+
+  size_t size() const;
+
+private:
+  std::vector<std::atomic<uint32_t>> parent_;
+};
+
+} // namespace Simhash
+
+#endif // SIMHASH_UNION_FIND_H
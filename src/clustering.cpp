@@ -0,0 +1,624 @@
+#include "../include/clustering.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+
+#include "../include/index.h"
+#include "../include/union_find.h"
+
+namespace
+{
+const char STATE_MAGIC[8] = {'S', 'I', 'M', 'H', 'C', 'L', 'S', '\0'};
+const uint32_t STATE_VERSION = 2;
+const uint32_t STATE_BYTE_ORDER = 0x01020304;
+
+/**
+ * The fixed header of a cluster state file, followed by `size` hashes and
+ * `size` cluster ids.
+ */
+struct state_header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t number_of_blocks;
+  uint32_t different_bits;
+  uint64_t size;
+  uint64_t next_cluster;
+};
+
+// Edges are hooked and filtered in blocks of this many, each block shrinking
+// in place as its edges fall within a single tree.
+const size_t EDGE_BLOCK = 1 << 16;
+
+// The total Hamming distance from `hash` to every hash in `sample`. The loop
+// has no branches or dependencies beyond the sum.
+uint64_t total_distance(Simhash::hash_t hash,
+                        const std::vector<Simhash::hash_t> &sample)
+{
+  uint64_t total(0);
+  const Simhash::hash_t *data = sample.data();
+  const size_t size = sample.size();
+#pragma omp simd reduction(+ : total)
+  for (size_t k = 0; k < size; ++k)
+  {
+    total += Simhash::popcount(hash ^ data[k]);
+  }
+  return total;
+}
+
+// The member of `members` with the smallest total distance to `sample`,
+// scanning the members in parallel if `parallel` is set.
+Simhash::index_t medoid(const Simhash::index_t *members, size_t size,
+                        const std::vector<Simhash::hash_t> &hashes,
+                        const std::vector<Simhash::hash_t> &sample,
+                        bool parallel)
+{
+  uint64_t best_total = std::numeric_limits<uint64_t>::max();
+  Simhash::index_t best = members[0];
+#pragma omp parallel if (parallel)
+  {
+    uint64_t local_total = std::numeric_limits<uint64_t>::max();
+    Simhash::index_t local = members[0];
+#pragma omp for schedule(static) nowait
+    for (size_t k = 0; k < size; ++k)
+    {
+      uint64_t total = total_distance(hashes[members[k]], sample);
+      if (total < local_total ||
+          (total == local_total && members[k] < local))
+      {
+        local_total = total;
+        local = members[k];
+      }
+    }
+#pragma omp critical
+    {
+      if (local_total < best_total ||
+          (local_total == best_total && local < best))
+      {
+        best_total = local_total;
+        best = local;
+      }
+    }
+  }
+  return best;
+}
+} // namespace
+
+Simhash::ClusterEngine Simhash::parse_cluster_engine(const std::string &name)
+{
+  if (name == "union_find")
+  {
+    return Simhash::ClusterEngine::union_find;
+  }
+  if (name == "components")
+  {
+    return Simhash::ClusterEngine::components;
+  }
+  if (name == "leader")
+  {
+    return Simhash::ClusterEngine::leader;
+  }
+  throw std::invalid_argument("Unknown clustering engine: " + name);
+}
+
+Simhash::Representative Simhash::parse_representative(const std::string &name)
+{
+  if (name == "medoid")
+  {
+    return Simhash::Representative::medoid;
+  }
+  if (name == "most_ids")
+  {
+    return Simhash::Representative::most_ids;
+  }
+  throw std::invalid_argument("Unknown representative: " + name);
+}
+
+Simhash::index_clusters_t
+Simhash::find_clusters(const std::vector<Simhash::hash_t> &hashes,
+                       size_t number_of_blocks, size_t different_bits,
+                       Simhash::ClusterEngine engine,
+                       Simhash::ProgressMode progress)
+{
+  if (engine == Simhash::ClusterEngine::union_find)
+  {
+    return find_clusters(hashes, number_of_blocks, different_bits, progress);
+  }
+  if (engine == Simhash::ClusterEngine::leader)
+  {
+    return find_leaders(hashes, number_of_blocks, different_bits, progress);
+  }
+
+  std::vector<Simhash::index_match_t> edges;
+  std::mutex mutex;
+  auto collect = [&edges, &mutex](const std::vector<Simhash::index_match_t> &batch)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    edges.insert(edges.end(), batch.begin(), batch.end());
+  };
+  find_all(hashes, number_of_blocks, different_bits, collect, progress);
+  return find_components(hashes.size(), std::move(edges));
+}
+
+Simhash::index_clusters_t
+Simhash::find_components(size_t size, std::vector<Simhash::index_match_t> edges)
+{
+  std::vector<std::atomic<Simhash::index_t>> labels(size);
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < size; ++i)
+  {
+    labels[i].store(static_cast<Simhash::index_t>(i), std::memory_order_relaxed);
+  }
+
+  size_t blocks = (edges.size() + EDGE_BLOCK - 1) / EDGE_BLOCK;
+  std::vector<size_t> kept(blocks);
+  for (size_t b = 0; b < blocks; ++b)
+  {
+    kept[b] = std::min(EDGE_BLOCK, edges.size() - b * EDGE_BLOCK);
+  }
+
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+
+    // Hook: link the larger root of every edge onto the smaller one. Labels
+    // only ever decrease, so the trees never form a cycle
+#pragma omp parallel for schedule(dynamic, 1) reduction(|| : changed)
+    for (size_t b = 0; b < blocks; ++b)
+    {
+      const Simhash::index_match_t *edge = edges.data() + b * EDGE_BLOCK;
+      for (size_t k = 0; k < kept[b]; ++k)
+      {
+        Simhash::index_t u = labels[edge[k].first].load(std::memory_order_relaxed);
+        Simhash::index_t v = labels[edge[k].second].load(std::memory_order_relaxed);
+        if (u == v)
+        {
+          continue;
+        }
+        // The edge joins two trees, so another round is needed either way;
+        // if the CAS fails, the root was already hooked elsewhere this round
+        Simhash::index_t high = std::max(u, v);
+        Simhash::index_t expected = high;
+        labels[high].compare_exchange_strong(expected, std::min(u, v),
+                                             std::memory_order_relaxed);
+        changed = true;
+      }
+    }
+
+    // Shortcut: point every label straight at its root
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < size; ++i)
+    {
+      Simhash::index_t label = labels[i].load(std::memory_order_relaxed);
+      Simhash::index_t root = labels[label].load(std::memory_order_relaxed);
+      while (label != root)
+      {
+        label = root;
+        root = labels[label].load(std::memory_order_relaxed);
+      }
+      labels[i].store(root, std::memory_order_relaxed);
+    }
+
+    // Drop the edges that lie within a single tree
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t b = 0; b < blocks; ++b)
+    {
+      Simhash::index_match_t *edge = edges.data() + b * EDGE_BLOCK;
+      size_t write = 0;
+      for (size_t k = 0; k < kept[b]; ++k)
+      {
+        if (labels[edge[k].first].load(std::memory_order_relaxed) !=
+            labels[edge[k].second].load(std::memory_order_relaxed))
+        {
+          edge[write++] = edge[k];
+        }
+      }
+      kept[b] = write;
+    }
+  }
+
+  std::vector<Simhash::index_t> roots(size);
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < size; ++i)
+  {
+    roots[i] = labels[i].load(std::memory_order_relaxed);
+  }
+  return Simhash::make_clusters(roots);
+}
+
+Simhash::index_clusters_t
+Simhash::find_leaders(const std::vector<Simhash::hash_t> &hashes,
+                      size_t number_of_blocks, size_t different_bits,
+                      Simhash::ProgressMode progress)
+{
+  // The leaders are indexed as they appear, so their ids in the index are in
+  // order of appearance and the smallest id found is the earliest leader
+  Simhash::Index leaders(std::vector<Simhash::hash_t>(), number_of_blocks,
+                         different_bits);
+  std::vector<Simhash::index_t> positions;
+  std::vector<Simhash::index_t> roots(hashes.size());
+
+  Simhash::Progress reporter(progress);
+  reporter.begin("leaders", 0, 1, hashes.size());
+  for (size_t i = 0; i < hashes.size(); ++i)
+  {
+    std::vector<uint64_t> found = leaders.find_ids(hashes[i]);
+    if (found.empty())
+    {
+      leaders.insert(hashes[i]);
+      positions.push_back(static_cast<Simhash::index_t>(i));
+      roots[i] = static_cast<Simhash::index_t>(i);
+    }
+    else
+    {
+      roots[i] = positions[found.front()];
+    }
+    reporter.advance(1);
+  }
+  reporter.end();
+
+  return Simhash::make_clusters(roots);
+}
+
+const uint64_t Simhash::ClusterState::NO_CLUSTER;
+
+Simhash::ClusterState Simhash::ClusterState::load(const std::string &path)
+{
+  std::ifstream in(path, std::ifstream::binary);
+  if (!in.good())
+  {
+    throw std::runtime_error("Error reading " + path);
+  }
+
+  state_header_t header;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in.good() ||
+      std::memcmp(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 ||
+      header.version != STATE_VERSION || header.byte_order != STATE_BYTE_ORDER)
+  {
+    throw std::runtime_error("Invalid cluster state file " + path);
+  }
+
+  if (header.number_of_blocks == 0 || header.number_of_blocks > Simhash::BITS ||
+      header.different_bits >= header.number_of_blocks)
+  {
+    throw std::runtime_error("Invalid cluster state file " + path +
+                             ": bad parameters");
+  }
+
+  // The arrays must fill the rest of the file exactly
+  in.seekg(0, std::ifstream::end);
+  uint64_t remaining = static_cast<uint64_t>(in.tellg()) - sizeof(header);
+  size_t row = sizeof(Simhash::hash_t) + sizeof(uint64_t);
+  if (!in.good() || remaining % row != 0 || remaining / row != header.size)
+  {
+    throw std::runtime_error("Invalid cluster state file " + path +
+                             ": wrong size");
+  }
+  in.seekg(sizeof(header));
+
+  // Every new cluster takes at least one new hash, so ids stay below the size
+  if (header.next_cluster > header.size)
+  {
+    throw std::runtime_error("Invalid cluster state file " + path +
+                             ": bad next cluster");
+  }
+
+  Simhash::ClusterState state;
+  state.number_of_blocks = header.number_of_blocks;
+  state.different_bits = header.different_bits;
+  state.next_cluster = header.next_cluster;
+  state.hashes.resize(header.size);
+  state.clusters.resize(header.size);
+  in.read(reinterpret_cast<char *>(state.hashes.data()),
+          header.size * sizeof(Simhash::hash_t));
+  in.read(reinterpret_cast<char *>(state.clusters.data()),
+          header.size * sizeof(uint64_t));
+  if (!in.good())
+  {
+    throw std::runtime_error("Invalid cluster state file " + path +
+                             ": truncated");
+  }
+
+  // Merging with new batches relies on sorted, distinct hashes
+  for (size_t i = 1; i < state.hashes.size(); ++i)
+  {
+    if (state.hashes[i - 1] >= state.hashes[i])
+    {
+      throw std::runtime_error("Invalid cluster state file " + path +
+                               ": hashes not sorted and distinct");
+    }
+  }
+  for (uint64_t cluster : state.clusters)
+  {
+    if (cluster != NO_CLUSTER && cluster >= state.next_cluster)
+    {
+      throw std::runtime_error("Invalid cluster state file " + path +
+                               ": cluster id out of range");
+    }
+  }
+  return state;
+}
+
+void Simhash::ClusterState::save(const std::string &path) const
+{
+  state_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+  header.version = STATE_VERSION;
+  header.byte_order = STATE_BYTE_ORDER;
+  header.number_of_blocks = static_cast<uint32_t>(number_of_blocks);
+  header.different_bits = static_cast<uint32_t>(different_bits);
+  header.size = hashes.size();
+  header.next_cluster = next_cluster;
+
+  std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(hashes.data()),
+            hashes.size() * sizeof(Simhash::hash_t));
+  out.write(reinterpret_cast<const char *>(clusters.data()),
+            clusters.size() * sizeof(uint64_t));
+  out.flush();
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+}
+
+Simhash::index_clusters_t
+Simhash::ClusterState::clusters_of(const std::vector<Simhash::hash_t> &batch,
+                                   std::vector<uint64_t> &ids) const
+{
+  // Pair every clustered index with its cluster, and sort by cluster
+  std::vector<std::pair<uint64_t, Simhash::index_t>> assigned;
+  for (size_t i = 0; i < batch.size(); ++i)
+  {
+    uint64_t cluster = clusters[Simhash::index_of(hashes, batch[i])];
+    if (cluster != NO_CLUSTER)
+    {
+      assigned.push_back(
+          std::make_pair(cluster, static_cast<Simhash::index_t>(i)));
+    }
+  }
+  std::sort(assigned.begin(), assigned.end());
+
+  Simhash::index_clusters_t result;
+  result.offsets.push_back(0);
+  for (size_t k = 0; k < assigned.size(); ++k)
+  {
+    if (k > 0 && assigned[k].first != assigned[k - 1].first)
+    {
+      result.offsets.push_back(static_cast<Simhash::index_t>(k));
+    }
+    if (k == 0 || assigned[k].first != assigned[k - 1].first)
+    {
+      ids.push_back(assigned[k].first);
+    }
+    result.members.push_back(assigned[k].second);
+  }
+  if (!assigned.empty())
+  {
+    result.offsets.push_back(static_cast<Simhash::index_t>(assigned.size()));
+  }
+  return result;
+}
+
+void Simhash::update_clusters(Simhash::ClusterState &state,
+                              const std::vector<Simhash::hash_t> &batch,
+                              size_t number_of_blocks, size_t different_bits,
+                              Simhash::ProgressMode progress)
+{
+  const Simhash::index_t none = std::numeric_limits<Simhash::index_t>::max();
+  const uint64_t no_cluster = Simhash::ClusterState::NO_CLUSTER;
+
+  // Edges of a different distance would silently mix two clusterings
+  if (state.number_of_blocks != 0 &&
+      (state.number_of_blocks != number_of_blocks ||
+       state.different_bits != different_bits))
+  {
+    throw std::invalid_argument(
+        "Cluster state was built with " +
+        std::to_string(state.number_of_blocks) + " blocks and distance " +
+        std::to_string(state.different_bits));
+  }
+  state.number_of_blocks = number_of_blocks;
+  state.different_bits = different_bits;
+
+  // Only the hashes not seen before need to be matched
+  std::vector<Simhash::hash_t> fresh;
+  std::set_difference(batch.begin(), batch.end(), state.hashes.begin(),
+                      state.hashes.end(), std::back_inserter(fresh));
+
+  if (state.hashes.size() + fresh.size() > none)
+  {
+    throw std::invalid_argument("Too many hashes for 32-bit indices");
+  }
+
+  // Merge the two, noting where each old and new hash lands
+  std::vector<Simhash::hash_t> hashes;
+  hashes.reserve(state.hashes.size() + fresh.size());
+  std::vector<Simhash::index_t> from_state(state.hashes.size());
+  std::vector<Simhash::index_t> from_fresh(fresh.size());
+  size_t s = 0, f = 0;
+  while (s < state.hashes.size() || f < fresh.size())
+  {
+    Simhash::index_t index = static_cast<Simhash::index_t>(hashes.size());
+    if (f == fresh.size() ||
+        (s < state.hashes.size() && state.hashes[s] < fresh[f]))
+    {
+      from_state[s] = index;
+      hashes.push_back(state.hashes[s++]);
+    }
+    else
+    {
+      from_fresh[f] = index;
+      hashes.push_back(fresh[f++]);
+    }
+  }
+
+  // Carry the existing clusters over to the merged indices
+  std::vector<uint64_t> previous(hashes.size(), no_cluster);
+  for (size_t i = 0; i < state.hashes.size(); ++i)
+  {
+    previous[from_state[i]] = state.clusters[i];
+  }
+
+  // Seed the forest with the existing clusters
+  Simhash::UnionFind forest(hashes.size());
+  std::vector<Simhash::index_t> first(state.next_cluster, none);
+  for (size_t i = 0; i < hashes.size(); ++i)
+  {
+    if (previous[i] == no_cluster)
+    {
+      continue;
+    }
+    Simhash::index_t &seed = first[previous[i]];
+    if (seed == none)
+    {
+      seed = static_cast<Simhash::index_t>(i);
+    }
+    else
+    {
+      forest.unite(seed, static_cast<Simhash::index_t>(i));
+    }
+  }
+
+  // Add the new edges: among the new hashes, and from them to the old ones
+  if (fresh.size() > 1)
+  {
+    Simhash::find_all(
+        fresh, number_of_blocks, different_bits,
+        [&forest, &from_fresh](
+            const std::vector<Simhash::index_match_t> &matches)
+        {
+          for (const Simhash::index_match_t &match : matches)
+          {
+            forest.unite(from_fresh[match.first], from_fresh[match.second]);
+          }
+        },
+        progress);
+  }
+  if (!fresh.empty() && !state.hashes.empty())
+  {
+    Simhash::find_between(
+        fresh, state.hashes, number_of_blocks, different_bits,
+        [&forest, &from_fresh, &from_state](
+            const std::vector<Simhash::index_match_t> &matches)
+        {
+          for (const Simhash::index_match_t &match : matches)
+          {
+            forest.unite(from_fresh[match.first], from_state[match.second]);
+          }
+        },
+        progress);
+  }
+
+  // Each set keeps the smallest existing id among its members, if any
+  std::vector<Simhash::index_t> roots(hashes.size());
+  std::vector<Simhash::index_t> counts(hashes.size(), 0);
+  std::vector<uint64_t> ids(hashes.size(), no_cluster);
+  for (size_t i = 0; i < hashes.size(); ++i)
+  {
+    roots[i] = forest.find(static_cast<Simhash::index_t>(i));
+    ++counts[roots[i]];
+    ids[roots[i]] = std::min(ids[roots[i]], previous[i]);
+  }
+
+  // Sets of two or more without an id get new ones, in order of their root
+  for (size_t i = 0; i < hashes.size(); ++i)
+  {
+    if (roots[i] == i && counts[i] > 1 && ids[i] == no_cluster)
+    {
+      ids[i] = state.next_cluster++;
+    }
+  }
+
+  state.clusters.resize(hashes.size());
+  for (size_t i = 0; i < hashes.size(); ++i)
+  {
+    state.clusters[i] = counts[roots[i]] > 1 ? ids[roots[i]] : no_cluster;
+  }
+  state.hashes.swap(hashes);
+}
+
+std::vector<Simhash::index_t>
+Simhash::find_representatives(const Simhash::index_clusters_t &clusters,
+                              const std::vector<Simhash::hash_t> &hashes,
+                              const std::vector<uint64_t> &offsets,
+                              Simhash::Representative mode)
+{
+  const Simhash::index_t *members = clusters.members.data();
+  std::vector<Simhash::index_t> representatives(clusters.size());
+
+  if (mode == Simhash::Representative::most_ids)
+  {
+#pragma omp parallel for schedule(dynamic, 256)
+    for (size_t c = 0; c < clusters.size(); ++c)
+    {
+      Simhash::index_t best = members[clusters.offsets[c]];
+      for (Simhash::index_t k = clusters.offsets[c] + 1;
+           k < clusters.offsets[c + 1]; ++k)
+      {
+        Simhash::index_t index = members[k];
+        uint64_t count = offsets[index + 1] - offsets[index];
+        uint64_t best_count = offsets[best + 1] - offsets[best];
+        if (count > best_count || (count == best_count && index < best))
+        {
+          best = index;
+        }
+      }
+      representatives[c] = best;
+    }
+    return representatives;
+  }
+
+  // Small clusters are spread over the threads, while each large one is
+  // scanned by all of them against a sample of its members
+  std::vector<size_t> large;
+#pragma omp parallel
+  {
+    std::vector<Simhash::hash_t> sample;
+#pragma omp for schedule(dynamic, 64)
+    for (size_t c = 0; c < clusters.size(); ++c)
+    {
+      size_t size = clusters.offsets[c + 1] - clusters.offsets[c];
+      if (size > Simhash::MEDOID_SAMPLE)
+      {
+#pragma omp critical
+        large.push_back(c);
+        continue;
+      }
+      const Simhash::index_t *first = members + clusters.offsets[c];
+      sample.clear();
+      for (size_t k = 0; k < size; ++k)
+      {
+        sample.push_back(hashes[first[k]]);
+      }
+      representatives[c] = medoid(first, size, hashes, sample, false);
+    }
+  }
+
+  std::vector<Simhash::hash_t> sample(Simhash::MEDOID_SAMPLE);
+  for (size_t c : large)
+  {
+    const Simhash::index_t *first = members + clusters.offsets[c];
+    size_t size = clusters.offsets[c + 1] - clusters.offsets[c];
+    for (size_t k = 0; k < sample.size(); ++k)
+    {
+      sample[k] = hashes[first[k * size / sample.size()]];
+    }
+    representatives[c] = medoid(first, size, hashes, sample, true);
+  }
+  return representatives;
+}
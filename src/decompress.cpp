@@ -0,0 +1,372 @@
+#include "../include/decompress.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <zlib.h>
+
+#ifdef SIMHASH_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "../include/mapped_file.h"
+
+namespace
+{
+const unsigned char GZIP_MAGIC[2] = {0x1f, 0x8b};
+const unsigned char ZSTD_MAGIC[4] = {0x28, 0xb5, 0x2f, 0xfd};
+
+// The most input handed to zlib at once, whose sizes are 32-bit.
+const size_t MAX_INFLATE_INPUT = size_t(1) << 30;
+
+/**
+ * One buffer of decompressed data in the ring.
+ */
+struct slot_t
+{
+  std::unique_ptr<char[]> data;
+  size_t size = 0;
+};
+} // namespace
+
+/**
+ * The stream buffer behind a DecompressedStream.
+ *
+ * The decoding thread takes an empty slot, fills it and queues it as full;
+ * `underflow` hands out the full slots in order, returning each one to the
+ * empty queue once it has been read. The thread waits whenever the whole
+ * ring is full, so at most DECODE_RING buffers are ever held.
+ */
+class Simhash::DecompressedStream::Buffer : public std::streambuf
+{
+public:
+  Buffer(const std::string &path, Simhash::Compression compression);
+  ~Buffer();
+
+  void check() const;
+
+protected:
+  int_type underflow() override;
+
+private:
+  void run();
+  void inflate_gzip();
+  void decompress_zstd();
+
+  // Wait for an empty slot, or return null once the stream is closing
+  slot_t *acquire();
+  void publish(slot_t *slot);
+
+  std::string path_;
+  Simhash::Compression compression_;
+  Simhash::MappedFile file_;
+
+  std::vector<slot_t> slots_;
+  std::deque<slot_t *> empty_, full_;
+  slot_t *current_;
+  bool done_, stopped_;
+  std::string error_;
+  mutable std::mutex mutex_;
+  std::condition_variable filled_, emptied_;
+  std::thread thread_;
+};
+
+Simhash::Compression Simhash::detect_compression(const std::string &path)
+{
+  std::ifstream stream(path, std::ifstream::in | std::ifstream::binary);
+  if (!stream.good())
+  {
+    throw std::runtime_error("Error reading " + path);
+  }
+  unsigned char magic[4] = {0, 0, 0, 0};
+  stream.read(reinterpret_cast<char *>(magic), sizeof(magic));
+  size_t size = stream.gcount();
+
+  if (size >= sizeof(GZIP_MAGIC) &&
+      std::memcmp(magic, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0)
+  {
+    return Simhash::Compression::gzip;
+  }
+  if (size >= sizeof(ZSTD_MAGIC) &&
+      std::memcmp(magic, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0)
+  {
+    return Simhash::Compression::zstd;
+  }
+  return Simhash::Compression::none;
+}
+
+bool Simhash::compression_supported(Simhash::Compression compression)
+{
+#ifdef SIMHASH_WITH_ZSTD
+  static_cast<void>(compression);
+  return true;
+#else
+  return compression != Simhash::Compression::zstd;
+#endif
+}
+
+Simhash::DecompressedStream::Buffer::Buffer(const std::string &path,
+                                            Simhash::Compression compression)
+    : path_(path), compression_(compression), file_(path), slots_(DECODE_RING),
+      current_(nullptr), done_(false), stopped_(false)
+{
+  if (!Simhash::compression_supported(compression))
+  {
+    throw std::runtime_error("Reading " + path +
+                             " needs a build with zstd support");
+  }
+  file_.advise(MADV_SEQUENTIAL);
+  for (slot_t &slot : slots_)
+  {
+    slot.data.reset(new char[DECODE_CHUNK]);
+    empty_.push_back(&slot);
+  }
+  thread_ = std::thread(&Buffer::run, this);
+}
+
+Simhash::DecompressedStream::Buffer::~Buffer()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  emptied_.notify_all();
+  thread_.join();
+}
+
+void Simhash::DecompressedStream::Buffer::check() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!error_.empty())
+  {
+    throw std::runtime_error(error_);
+  }
+}
+
+Simhash::DecompressedStream::Buffer::int_type
+Simhash::DecompressedStream::Buffer::underflow()
+{
+  if (gptr() < egptr())
+  {
+    return traits_type::to_int_type(*gptr());
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (current_)
+  {
+    empty_.push_back(current_);
+    current_ = nullptr;
+    emptied_.notify_one();
+  }
+  filled_.wait(lock, [this] { return !full_.empty() || done_; });
+  if (full_.empty())
+  {
+    return traits_type::eof();
+  }
+  current_ = full_.front();
+  full_.pop_front();
+  setg(current_->data.get(), current_->data.get(),
+       current_->data.get() + current_->size);
+  return traits_type::to_int_type(*gptr());
+}
+
+void Simhash::DecompressedStream::Buffer::run()
+{
+  // The reader only sees the end of the stream, so the error is kept for
+  // `check`
+  try
+  {
+    if (compression_ == Simhash::Compression::gzip)
+    {
+      inflate_gzip();
+    }
+    else
+    {
+      decompress_zstd();
+    }
+  }
+  catch (const std::exception &e)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_ = e.what();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  filled_.notify_all();
+}
+
+slot_t *Simhash::DecompressedStream::Buffer::acquire()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  emptied_.wait(lock, [this] { return !empty_.empty() || stopped_; });
+  if (stopped_)
+  {
+    return nullptr;
+  }
+  slot_t *slot = empty_.front();
+  empty_.pop_front();
+  slot->size = 0;
+  return slot;
+}
+
+void Simhash::DecompressedStream::Buffer::publish(slot_t *slot)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (slot->size == 0)
+    {
+      empty_.push_back(slot);
+      return;
+    }
+    full_.push_back(slot);
+  }
+  filled_.notify_one();
+}
+
+void Simhash::DecompressedStream::Buffer::inflate_gzip()
+{
+  const unsigned char *in =
+      reinterpret_cast<const unsigned char *>(file_.data());
+  const unsigned char *end = in + file_.size();
+
+  z_stream stream;
+  std::memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 15 + 16) != Z_OK)
+  {
+    throw std::runtime_error("Error decompressing " + path_);
+  }
+
+  try
+  {
+    slot_t *slot = acquire();
+    while (slot)
+    {
+      if (slot->size == DECODE_CHUNK)
+      {
+        publish(slot);
+        slot = acquire();
+        continue;
+      }
+      if (stream.avail_in == 0)
+      {
+        if (in == end)
+        {
+          throw std::runtime_error("Unexpected end of " + path_);
+        }
+        size_t take = std::min<size_t>(end - in, MAX_INFLATE_INPUT);
+        stream.next_in = const_cast<unsigned char *>(in);
+        stream.avail_in = static_cast<uInt>(take);
+        in += take;
+      }
+
+      stream.next_out =
+          reinterpret_cast<Bytef *>(slot->data.get() + slot->size);
+      stream.avail_out = static_cast<uInt>(DECODE_CHUNK - slot->size);
+      int status = inflate(&stream, Z_NO_FLUSH);
+      slot->size = DECODE_CHUNK - stream.avail_out;
+
+      if (status == Z_STREAM_END)
+      {
+        // Another member may follow, as written by pigz or bgzip
+        if (stream.avail_in == 0 && in == end)
+        {
+          publish(slot);
+          break;
+        }
+        inflateReset(&stream);
+      }
+      else if (status != Z_OK && status != Z_BUF_ERROR)
+      {
+        throw std::runtime_error("Error decompressing " + path_ + ": " +
+                                 (stream.msg ? stream.msg : "corrupt data"));
+      }
+    }
+  }
+  catch (...)
+  {
+    inflateEnd(&stream);
+    throw;
+  }
+  inflateEnd(&stream);
+}
+
+void Simhash::DecompressedStream::Buffer::decompress_zstd()
+{
+#ifdef SIMHASH_WITH_ZSTD
+  ZSTD_DCtx *context = ZSTD_createDCtx();
+  if (context == nullptr)
+  {
+    throw std::runtime_error("Error decompressing " + path_);
+  }
+
+  try
+  {
+    ZSTD_inBuffer input = {file_.data(), file_.size(), 0};
+    size_t status = 0;
+    slot_t *slot = acquire();
+    while (slot)
+    {
+      if (slot->size == DECODE_CHUNK)
+      {
+        publish(slot);
+        slot = acquire();
+        continue;
+      }
+
+      ZSTD_outBuffer output = {slot->data.get(), DECODE_CHUNK, slot->size};
+      status = ZSTD_decompressStream(context, &output, &input);
+      if (ZSTD_isError(status))
+      {
+        throw std::runtime_error("Error decompressing " + path_ + ": " +
+                                 ZSTD_getErrorName(status));
+      }
+      slot->size = output.pos;
+
+      // With room left over, everything decoded so far has been flushed
+      if (input.pos == input.size && output.pos < output.size)
+      {
+        if (status != 0)
+        {
+          throw std::runtime_error("Unexpected end of " + path_);
+        }
+        publish(slot);
+        break;
+      }
+    }
+  }
+  catch (...)
+  {
+    ZSTD_freeDCtx(context);
+    throw;
+  }
+  ZSTD_freeDCtx(context);
+#endif
+}
+
+Simhash::DecompressedStream::DecompressedStream(
+    const std::string &path, Simhash::Compression compression)
+    : std::istream(nullptr), buffer_(new Buffer(path, compression))
+{
+  rdbuf(buffer_.get());
+}
+
+Simhash::DecompressedStream::~DecompressedStream()
+{
+}
+
+void Simhash::DecompressedStream::check() const
+{
+  buffer_->check();
+}
@@ -0,0 +1,138 @@
+#include "../include/graph.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+
+#include "../include/union_find.h"
+
+namespace
+{
+const char GRAPH_MAGIC[8] = {'S', 'I', 'M', 'H', 'C', 'S', 'R', '\0'};
+const uint32_t GRAPH_VERSION = 1;
+const uint32_t GRAPH_BYTE_ORDER = 0x01020304;
+
+/**
+ * The fixed header of a graph file, followed by `nodes` hashes, `nodes + 1`
+ * offsets and `neighbors` neighbors.
+ */
+struct graph_header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t nodes;
+  uint64_t neighbors;
+};
+} // namespace
+
+Simhash::Graph
+Simhash::Graph::build(size_t size,
+                      const std::vector<Simhash::index_match_t> &edges)
+{
+  Simhash::Graph graph;
+  graph.offsets.assign(size + 1, 0);
+
+  // Count the degree of every node
+#pragma omp parallel for schedule(static)
+  for (size_t e = 0; e < edges.size(); ++e)
+  {
+#pragma omp atomic
+    ++graph.offsets[edges[e].first + 1];
+#pragma omp atomic
+    ++graph.offsets[edges[e].second + 1];
+  }
+  for (size_t i = 0; i < size; ++i)
+  {
+    graph.offsets[i + 1] += graph.offsets[i];
+  }
+
+  // Scatter both directions of every edge to the next free slot of its source
+  std::vector<uint64_t> next(graph.offsets.begin(), graph.offsets.end() - 1);
+  graph.neighbors.resize(graph.offsets.back());
+#pragma omp parallel for schedule(static)
+  for (size_t e = 0; e < edges.size(); ++e)
+  {
+    uint64_t slot;
+#pragma omp atomic capture
+    slot = next[edges[e].first]++;
+    graph.neighbors[slot] = edges[e].second;
+#pragma omp atomic capture
+    slot = next[edges[e].second]++;
+    graph.neighbors[slot] = edges[e].first;
+  }
+
+#pragma omp parallel for schedule(dynamic, 1024)
+  for (size_t i = 0; i < size; ++i)
+  {
+    std::sort(graph.neighbors.begin() + graph.offsets[i],
+              graph.neighbors.begin() + graph.offsets[i + 1]);
+  }
+  return graph;
+}
+
+void Simhash::Graph::save(const std::string &path,
+                          const std::vector<Simhash::hash_t> &hashes) const
+{
+  graph_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC));
+  header.version = GRAPH_VERSION;
+  header.byte_order = GRAPH_BYTE_ORDER;
+  header.nodes = size();
+  header.neighbors = neighbors.size();
+
+  std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(hashes.data()),
+            hashes.size() * sizeof(Simhash::hash_t));
+  out.write(reinterpret_cast<const char *>(offsets.data()),
+            offsets.size() * sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(neighbors.data()),
+            neighbors.size() * sizeof(Simhash::index_t));
+  out.flush();
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+}
+
+Simhash::Graph Simhash::find_graph(const std::vector<Simhash::hash_t> &hashes,
+                                   size_t number_of_blocks,
+                                   size_t different_bits,
+                                   Simhash::ProgressMode progress)
+{
+  std::vector<Simhash::index_match_t> edges;
+  std::mutex mutex;
+  auto collect = [&edges, &mutex](const std::vector<Simhash::index_match_t> &batch)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    edges.insert(edges.end(), batch.begin(), batch.end());
+  };
+  find_all(hashes, number_of_blocks, different_bits, collect, progress);
+  return Simhash::Graph::build(hashes.size(), edges);
+}
+
+Simhash::index_clusters_t Simhash::find_clusters(const Simhash::Graph &graph)
+{
+  Simhash::UnionFind forest(graph.size());
+#pragma omp parallel for schedule(dynamic, 1024)
+  for (size_t i = 0; i < graph.size(); ++i)
+  {
+    for (uint64_t k = graph.offsets[i]; k < graph.offsets[i + 1]; ++k)
+    {
+      // Each edge is stored twice, so only unite it from its smaller end
+      if (graph.neighbors[k] > i)
+      {
+        forest.unite(static_cast<Simhash::index_t>(i), graph.neighbors[k]);
+      }
+    }
+  }
+  return Simhash::make_clusters(forest);
+}
@@ -0,0 +1,248 @@
+#include "../include/ids.h"
+
+#include <unordered_set>
+
+namespace
+{
+// The most digits of an unsigned 64-bit integer.
+const size_t MAX_DIGITS = 20;
+
+// Parse [begin, end) as a canonical decimal integer: an optional minus sign,
+// no leading zeros and no negative zero, so that it prints back exactly as
+// it was written. Non-negative values must fit in a uint64_t and negative
+// ones in an int64_t, whose bits are stored in `value`.
+bool parse_integer(const char *begin, const char *end, uint64_t &value,
+                   bool &negative)
+{
+  negative = begin < end && *begin == '-';
+  const char *first = negative ? begin + 1 : begin;
+  size_t size = end - first;
+  if (size == 0 || size > MAX_DIGITS || (*first == '0' && size > 1) ||
+      (negative && *first == '0'))
+  {
+    return false;
+  }
+  value = 0;
+  for (const char *it = first; it < end; ++it)
+  {
+    if (*it < '0' || *it > '9')
+    {
+      return false;
+    }
+    uint64_t digit = *it - '0';
+    if (value > (UINT64_MAX - digit) / 10)
+    {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  if (negative)
+  {
+    // The magnitude of INT64_MIN is the largest that fits
+    if (value > uint64_t(1) << 63)
+    {
+      return false;
+    }
+    value = 0 - value;
+  }
+  return true;
+}
+} // namespace
+
+void Simhash::append_decimal(std::string &out, uint64_t value)
+{
+  // Fill a buffer from its end, then copy the digits in one go
+  char digits[20];
+  char *it = digits + sizeof(digits);
+  do
+  {
+    *--it = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  out.append(it, digits + sizeof(digits));
+}
+
+void Simhash::append_decimal(std::string &out, int64_t value)
+{
+  if (value < 0)
+  {
+    out.push_back('-');
+    Simhash::append_decimal(out, 0 - static_cast<uint64_t>(value));
+    return;
+  }
+  Simhash::append_decimal(out, static_cast<uint64_t>(value));
+}
+
+void Simhash::IdTable::push_back(const char *begin, const char *end)
+{
+  // Integers take the whole slot, with their kind kept alongside
+  uint64_t value;
+  bool negative;
+  if (parse_integer(begin, end, value, negative))
+  {
+    slots_.push_back(value);
+    kinds_.push_back(negative ? NEGATIVE : UNSIGNED);
+    return;
+  }
+
+  // Intern the text behind a variable-length size
+  slots_.push_back(arena_.size());
+  kinds_.push_back(TEXT);
+  uint64_t size = end - begin;
+  while (size >= 0x80)
+  {
+    arena_.push_back(static_cast<char>(0x80 | (size & 0x7F)));
+    size >>= 7;
+  }
+  arena_.push_back(static_cast<char>(size));
+  arena_.append(begin, end);
+}
+
+void Simhash::IdTable::push_back(uint64_t value)
+{
+  slots_.push_back(value);
+  kinds_.push_back(UNSIGNED);
+}
+
+void Simhash::IdTable::reserve(size_t size)
+{
+  slots_.reserve(size);
+  kinds_.reserve(size);
+}
+
+size_t Simhash::IdTable::size() const
+{
+  return slots_.size();
+}
+
+bool Simhash::IdTable::is_integer(size_t i) const
+{
+  return kinds_[i] != TEXT;
+}
+
+bool Simhash::IdTable::is_negative(size_t i) const
+{
+  return kinds_[i] == NEGATIVE;
+}
+
+uint64_t Simhash::IdTable::integer(size_t i) const
+{
+  return slots_[i];
+}
+
+const char *Simhash::IdTable::text(size_t i, size_t &size) const
+{
+  const char *it = arena_.data() + slots_[i];
+  size = 0;
+  for (int shift = 0;; shift += 7)
+  {
+    unsigned char byte = static_cast<unsigned char>(*it++);
+    size |= static_cast<size_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      return it;
+    }
+  }
+}
+
+void Simhash::IdTable::append_to(std::string &out, size_t i) const
+{
+  if (kinds_[i] == UNSIGNED)
+  {
+    Simhash::append_decimal(out, slots_[i]);
+    return;
+  }
+  if (kinds_[i] == NEGATIVE)
+  {
+    Simhash::append_decimal(out, static_cast<int64_t>(slots_[i]));
+    return;
+  }
+  size_t size;
+  const char *data = text(i, size);
+  out.append(data, size);
+}
+
+void Simhash::IdTable::append(const Simhash::IdTable &other, size_t count)
+{
+  uint64_t base = arena_.size();
+  slots_.reserve(slots_.size() + count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    uint64_t slot = other.slots_[i];
+    slots_.push_back(other.kinds_[i] == TEXT ? slot + base : slot);
+  }
+  kinds_.insert(kinds_.end(), other.kinds_.begin(),
+                other.kinds_.begin() + count);
+  arena_ += other.arena_;
+}
+
+void Simhash::IdTable::permute(const std::vector<uint64_t> &order)
+{
+  std::vector<uint64_t> slots(order.size());
+  std::vector<uint8_t> kinds(order.size());
+#pragma omp parallel for schedule(static)
+  for (size_t k = 0; k < order.size(); ++k)
+  {
+    slots[k] = slots_[order[k]];
+    kinds[k] = kinds_[order[k]];
+  }
+  slots_.swap(slots);
+  kinds_.swap(kinds);
+}
+
+void Simhash::IdTable::deduplicate(std::vector<uint64_t> &offsets)
+{
+  // Find the repeats in parallel; most ranges hold a single id, and only the
+  // others need a set
+  size_t ranges = offsets.empty() ? 0 : offsets.size() - 1;
+  std::vector<uint8_t> keep(slots_.size(), 1);
+  size_t dropped = 0;
+#pragma omp parallel reduction(+ : dropped)
+  {
+    std::unordered_set<std::string> seen;
+    std::string key;
+#pragma omp for schedule(dynamic, 4096)
+    for (size_t i = 0; i < ranges; ++i)
+    {
+      if (offsets[i + 1] - offsets[i] < 2)
+      {
+        continue;
+      }
+      seen.clear();
+      for (uint64_t j = offsets[i]; j < offsets[i + 1]; ++j)
+      {
+        key.clear();
+        append_to(key, j);
+        if (!seen.insert(key).second)
+        {
+          keep[j] = 0;
+          ++dropped;
+        }
+      }
+    }
+  }
+  if (dropped == 0)
+  {
+    return;
+  }
+
+  // Only compact when something was dropped
+  uint64_t out = 0;
+  for (size_t i = 0; i < ranges; ++i)
+  {
+    uint64_t first = offsets[i];
+    uint64_t last = offsets[i + 1];
+    offsets[i] = out;
+    for (uint64_t j = first; j < last; ++j)
+    {
+      if (keep[j])
+      {
+        slots_[out] = slots_[j];
+        kinds_[out++] = kinds_[j];
+      }
+    }
+  }
+  offsets.back() = out;
+  slots_.resize(out);
+  kinds_.resize(out);
+}
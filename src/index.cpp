@@ -0,0 +1,808 @@
+#include "../include/index.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+
+#include "../include/mapped_file.h"
+
+namespace
+{
+const char INDEX_MAGIC[8] = {'S', 'I', 'M', 'H', 'I', 'D', 'X', '\0'};
+const uint32_t INDEX_VERSION = 2;
+const uint32_t INDEX_BYTE_ORDER = 0x01020304;
+const uint64_t INDEX_ALIGNMENT = 4096;
+
+// The insert buffer is frozen into a run once it holds this many hashes.
+const size_t BUFFER_CAPACITY = 4096;
+
+// Runs are merged once there are this many of them in the same size tier.
+const size_t COMPACTION_FANOUT = 4;
+
+/**
+ * The fixed header of an index file.
+ *
+ * It is followed by the masks of every permutation (`tables` rows of
+ * `number_of_blocks` masks), then the file offsets of the stored hashes, the
+ * ids and each of the `tables` permuted tables.
+ */
+struct index_header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t number_of_blocks;
+  uint32_t different_bits;
+  uint32_t tables;
+  uint32_t alignment;
+  uint64_t size;
+  uint64_t distinct;
+  uint64_t next_id;
+};
+
+uint64_t align(uint64_t offset)
+{
+  return (offset + INDEX_ALIGNMENT - 1) / INDEX_ALIGNMENT * INDEX_ALIGNMENT;
+}
+
+void invalid(const std::string &path, const std::string &reason)
+{
+  throw std::runtime_error("Invalid index file " + path + ": " + reason);
+}
+
+// The number of ways to choose `k` of `n` blocks, or `limit + 1` if that is
+// larger than `limit`.
+uint64_t choices(uint64_t n, uint64_t k, uint64_t limit)
+{
+  uint64_t result = 1;
+  for (uint64_t i = 1; i <= k; ++i)
+  {
+    // Exact at every step, and small enough not to overflow below the limit
+    result = result * (n - k + i) / i;
+    if (result > limit)
+    {
+      return limit + 1;
+    }
+  }
+  return result;
+}
+
+/**
+ * A sorted set of stored hashes with the permuted tables over them.
+ *
+ * The views either point into the owned vectors or into a mapped file.
+ */
+struct run_t
+{
+  std::vector<std::vector<Simhash::hash_t>> owned_tables;
+  std::vector<Simhash::hash_t> owned_hashes;
+  std::vector<uint64_t> owned_ids;
+  std::shared_ptr<Simhash::MappedFile> file;
+
+  std::vector<const Simhash::hash_t *> tables;
+  size_t distinct = 0;
+  const Simhash::hash_t *hashes = nullptr;
+  const uint64_t *ids = nullptr;
+  size_t size = 0;
+
+  // Point the views at the owned storage.
+  void adopt()
+  {
+    tables.clear();
+    for (const auto &table : owned_tables)
+    {
+      tables.push_back(table.data());
+    }
+    distinct = owned_tables.empty() ? 0 : owned_tables.front().size();
+    hashes = owned_hashes.data();
+    ids = owned_ids.data();
+    size = owned_hashes.size();
+  }
+};
+
+typedef std::shared_ptr<const run_t> run_ptr;
+
+// The size tier of a run: runs in the same tier are within a factor of the
+// fanout of each other.
+size_t tier(size_t size)
+{
+  size_t result = 0;
+  for (size = size / BUFFER_CAPACITY; size >= COMPACTION_FANOUT;
+       size /= COMPACTION_FANOUT)
+  {
+    ++result;
+  }
+  return result;
+}
+} // namespace
+
+struct Simhash::Index::State
+{
+  State(size_t number_of_blocks, size_t different_bits,
+        std::vector<Simhash::Permutation> permutations)
+      : number_of_blocks(number_of_blocks), different_bits(different_bits),
+        permutations(std::move(permutations)), next_id(0), stop(false)
+  {
+    buffer.owned_tables.resize(this->permutations.size());
+    buffer.adopt();
+  }
+
+  ~State()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    if (compactor.joinable())
+    {
+      compactor.join();
+    }
+  }
+
+  /**
+   * Append the hashes in `run` within `different_bits` of `query` to
+   * `results`. A hash may be appended once per table it is found in.
+   */
+  void search(const run_t &run, Simhash::hash_t query,
+              std::vector<Simhash::hash_t> &results) const
+  {
+    for (size_t i = 0; i < permutations.size(); ++i)
+    {
+      const Simhash::Permutation &permutation = permutations[i];
+      const Simhash::hash_t *table = run.tables[i];
+
+      // Every candidate shares the query's prefix, so it lies within
+      // [low, high]
+      Simhash::hash_t permuted = permutation.apply(query);
+      Simhash::hash_t mask = permutation.search_mask();
+      Simhash::hash_t low = permuted & mask;
+      Simhash::hash_t high = permuted | ~mask;
+
+      const Simhash::hash_t *it =
+          std::lower_bound(table, table + run.distinct, low);
+      for (; it != table + run.distinct && *it <= high; ++it)
+      {
+        if (Simhash::num_differing_bits(*it, permuted) <= different_bits)
+        {
+          results.push_back(permutation.reverse(*it));
+        }
+      }
+    }
+  }
+
+  /**
+   * Append the ids of the hashes in `run` within `different_bits` of `query`
+   * to `results`.
+   */
+  void search_ids(const run_t &run, Simhash::hash_t query,
+                  std::vector<uint64_t> &results) const
+  {
+    std::vector<Simhash::hash_t> found;
+    search(run, query, found);
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    for (Simhash::hash_t hash : found)
+    {
+      auto range = std::equal_range(run.hashes, run.hashes + run.size, hash);
+      results.insert(results.end(), run.ids + (range.first - run.hashes),
+                     run.ids + (range.second - run.hashes));
+    }
+  }
+
+  /**
+   * Append the matches between `sorted`, the batch permuted by permutation
+   * `i` and sorted, and the table `i` of `run` to `results`.
+   *
+   * Both sides are sorted, so each thread walks its slice of the batch and
+   * only moves forward through the table.
+   */
+  void join(const run_t &run, size_t i,
+            const std::vector<Simhash::hash_t> &sorted,
+            std::vector<Simhash::match_t> &results) const
+  {
+    const Simhash::Permutation &permutation = permutations[i];
+    const Simhash::hash_t *table = run.tables[i];
+    const Simhash::hash_t *end = table + run.distinct;
+    Simhash::hash_t mask = permutation.search_mask();
+
+#pragma omp parallel default(shared)
+    {
+      std::vector<Simhash::match_t> local;
+      const Simhash::hash_t *start = table;
+      bool positioned = false;
+      Simhash::hash_t prefix = 0;
+
+#pragma omp for schedule(static) nowait
+      for (size_t j = 0; j < sorted.size(); ++j)
+      {
+        Simhash::hash_t permuted = sorted[j];
+        if (!positioned || (permuted & mask) != prefix)
+        {
+          prefix = permuted & mask;
+          start = std::lower_bound(start, end, prefix);
+          positioned = true;
+        }
+
+        Simhash::hash_t high = permuted | ~mask;
+        for (const Simhash::hash_t *it = start; it != end && *it <= high; ++it)
+        {
+          if (Simhash::num_differing_bits(*it, permuted) <= different_bits)
+          {
+            local.push_back(std::make_pair(permutation.reverse(permuted),
+                                           permutation.reverse(*it)));
+          }
+        }
+      }
+
+#pragma omp critical(simhash_index_join)
+      results.insert(results.end(), local.begin(), local.end());
+    }
+  }
+
+  /**
+   * Merge `runs` into a single run with owned storage.
+   */
+  std::shared_ptr<run_t> merge(const std::vector<const run_t *> &runs) const
+  {
+    auto merged = std::make_shared<run_t>();
+    merged->owned_tables.resize(permutations.size());
+
+    for (const run_t *run : runs)
+    {
+      // Merge the hashes, keeping the ids of a hash in ascending order
+      std::vector<Simhash::hash_t> hashes;
+      std::vector<uint64_t> ids;
+      hashes.reserve(merged->owned_hashes.size() + run->size);
+      ids.reserve(merged->owned_hashes.size() + run->size);
+      size_t a = 0, b = 0;
+      const std::vector<Simhash::hash_t> &left = merged->owned_hashes;
+      while (a < left.size() || b < run->size)
+      {
+        bool take_left =
+            b == run->size ||
+            (a < left.size() &&
+             (left[a] < run->hashes[b] ||
+              (left[a] == run->hashes[b] && merged->owned_ids[a] < run->ids[b])));
+        if (take_left)
+        {
+          hashes.push_back(left[a]);
+          ids.push_back(merged->owned_ids[a++]);
+        }
+        else
+        {
+          hashes.push_back(run->hashes[b]);
+          ids.push_back(run->ids[b++]);
+        }
+      }
+      merged->owned_hashes.swap(hashes);
+      merged->owned_ids.swap(ids);
+    }
+
+    // Merge each permuted table independently, dropping repeats
+#pragma omp parallel for schedule(dynamic, 1) default(shared)
+    for (size_t i = 0; i < permutations.size(); ++i)
+    {
+      std::vector<Simhash::hash_t> &table = merged->owned_tables[i];
+      for (const run_t *run : runs)
+      {
+        std::vector<Simhash::hash_t> next;
+        next.reserve(table.size() + run->distinct);
+        std::merge(table.begin(), table.end(), run->tables[i],
+                   run->tables[i] + run->distinct, std::back_inserter(next));
+        next.erase(std::unique(next.begin(), next.end()), next.end());
+        table.swap(next);
+      }
+    }
+
+    merged->adopt();
+    return merged;
+  }
+
+  /**
+   * Freeze the buffer into a run and wake the compactor. Must be called with
+   * `mutex` held.
+   */
+  void flush()
+  {
+    if (buffer.size == 0)
+    {
+      return;
+    }
+    auto run = std::make_shared<run_t>(std::move(buffer));
+    run->adopt();
+    runs.push_back(run);
+
+    buffer = run_t();
+    buffer.owned_tables.resize(permutations.size());
+    buffer.adopt();
+
+    if (!compactor.joinable())
+    {
+      compactor = std::thread(&State::compact, this);
+    }
+    wake.notify_one();
+  }
+
+  /**
+   * The compactor thread: whenever a size tier holds enough runs, merge them
+   * outside of the lock and swap the merged run in.
+   */
+  void compact()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop)
+    {
+      // Pick the smallest tier with enough runs to merge
+      std::vector<size_t> counts;
+      for (const run_ptr &run : runs)
+      {
+        size_t t = tier(run->size);
+        if (t >= counts.size())
+        {
+          counts.resize(t + 1, 0);
+        }
+        ++counts[t];
+      }
+      size_t chosen = 0;
+      while (chosen < counts.size() && counts[chosen] < COMPACTION_FANOUT)
+      {
+        ++chosen;
+      }
+      if (chosen == counts.size())
+      {
+        wake.wait(lock);
+        continue;
+      }
+
+      std::vector<run_ptr> group;
+      std::vector<const run_t *> inputs;
+      for (const run_ptr &run : runs)
+      {
+        if (tier(run->size) == chosen)
+        {
+          group.push_back(run);
+          inputs.push_back(run.get());
+        }
+      }
+
+      lock.unlock();
+      run_ptr merged = merge(inputs);
+      lock.lock();
+
+      // Only this thread removes runs, so all of the group is still there
+      runs.erase(std::remove_if(runs.begin(), runs.end(),
+                                [&group](const run_ptr &run)
+                                {
+                                  return std::find(group.begin(), group.end(),
+                                                   run) != group.end();
+                                }),
+                 runs.end());
+      runs.push_back(merged);
+    }
+  }
+
+  size_t number_of_blocks;
+  size_t different_bits;
+  std::vector<Simhash::Permutation> permutations;
+
+  // Guarded by mutex
+  std::vector<run_ptr> runs;
+  run_t buffer;
+  uint64_t next_id;
+  bool stop;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::thread compactor;
+};
+
+Simhash::Index::Index(std::unique_ptr<State> state) : state_(std::move(state))
+{
+}
+
+Simhash::Index::Index(const std::vector<Simhash::hash_t> &hashes,
+                      size_t number_of_blocks, size_t different_bits)
+    : state_(new State(
+          number_of_blocks, different_bits,
+          Simhash::Permutation::create(number_of_blocks, different_bits)))
+{
+  State &state = *state_;
+  auto run = std::make_shared<run_t>();
+
+  // Sort the ids by their hash, so that the ids of a hash are contiguous
+  run->owned_ids.resize(hashes.size());
+  std::iota(run->owned_ids.begin(), run->owned_ids.end(), 0);
+  std::sort(run->owned_ids.begin(), run->owned_ids.end(),
+            [&hashes](uint64_t a, uint64_t b)
+            { return hashes[a] < hashes[b] || (hashes[a] == hashes[b] && a < b); });
+  run->owned_hashes.reserve(hashes.size());
+  for (uint64_t id : run->owned_ids)
+  {
+    run->owned_hashes.push_back(hashes[id]);
+  }
+
+  std::vector<Simhash::hash_t> distinct(run->owned_hashes);
+  distinct.erase(std::unique(distinct.begin(), distinct.end()),
+                 distinct.end());
+
+  // Build each permuted table independently
+  run->owned_tables.resize(state.permutations.size());
+#pragma omp parallel for schedule(dynamic, 1) default(shared)
+  for (size_t i = 0; i < state.permutations.size(); ++i)
+  {
+    const Simhash::Permutation &permutation = state.permutations[i];
+    std::vector<Simhash::hash_t> &table = run->owned_tables[i];
+    table.resize(distinct.size());
+    std::transform(distinct.begin(), distinct.end(), table.begin(),
+                   [&permutation](Simhash::hash_t h) -> Simhash::hash_t
+                   { return permutation.apply(h); });
+    std::sort(table.begin(), table.end());
+  }
+
+  run->adopt();
+  if (run->size > 0)
+  {
+    state.runs.push_back(run);
+  }
+  state.next_id = hashes.size();
+}
+
+Simhash::Index::~Index() = default;
+Simhash::Index::Index(Simhash::Index &&) = default;
+Simhash::Index &Simhash::Index::operator=(Simhash::Index &&) = default;
+
+Simhash::Index Simhash::Index::open(const std::string &path)
+{
+  auto file = std::make_shared<Simhash::MappedFile>(path);
+  const char *data = file->data();
+  size_t length = file->size();
+
+  index_header_t header;
+  if (length < sizeof(header))
+  {
+    invalid(path, "truncated header");
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+  {
+    invalid(path, "bad magic");
+  }
+  if (header.version != INDEX_VERSION)
+  {
+    invalid(path, "unsupported version " + std::to_string(header.version));
+  }
+  if (header.byte_order != INDEX_BYTE_ORDER)
+  {
+    invalid(path, "written with a different byte order");
+  }
+
+  // The parameters must be valid, and give exactly the stored tables
+  if (header.number_of_blocks == 0 || header.number_of_blocks > Simhash::BITS ||
+      header.different_bits >= header.number_of_blocks)
+  {
+    invalid(path, "bad parameters");
+  }
+  if (choices(header.number_of_blocks,
+              header.number_of_blocks - header.different_bits,
+              header.tables) != header.tables)
+  {
+    invalid(path, "wrong number of tables");
+  }
+  if (header.distinct > header.size)
+  {
+    invalid(path, "more distinct hashes than hashes");
+  }
+
+  // Read the masks and section offsets following the header
+  uint64_t masks =
+      static_cast<uint64_t>(header.tables) * header.number_of_blocks;
+  uint64_t sections = 2 + static_cast<uint64_t>(header.tables);
+  if (masks + sections > (length - sizeof(header)) / sizeof(uint64_t))
+  {
+    invalid(path, "truncated header");
+  }
+  std::vector<uint64_t> values(masks + sections);
+  std::memcpy(values.data(), data + sizeof(header),
+              values.size() * sizeof(uint64_t));
+
+  // Rebuild the permutations rather than trusting the stored masks
+  std::vector<Simhash::Permutation> permutations =
+      Simhash::Permutation::create(header.number_of_blocks,
+                                   header.different_bits);
+  for (size_t i = 0; i < permutations.size(); ++i)
+  {
+    if (!std::equal(permutations[i].masks().begin(),
+                    permutations[i].masks().end(),
+                    values.begin() + i * header.number_of_blocks))
+    {
+      invalid(path, "unexpected permutation masks");
+    }
+  }
+
+  // Every section must lie within the file and be aligned for its values
+  auto section = [&](size_t i, uint64_t count) -> const char *
+  {
+    uint64_t offset = values[masks + i];
+    if (offset % sizeof(uint64_t) != 0 || offset > length ||
+        count > (length - offset) / sizeof(uint64_t))
+    {
+      invalid(path, "section out of bounds");
+    }
+    return data + offset;
+  };
+
+  std::unique_ptr<State> state(new State(
+      header.number_of_blocks, header.different_bits, std::move(permutations)));
+  auto run = std::make_shared<run_t>();
+  run->size = header.size;
+  run->distinct = header.distinct;
+  run->hashes = reinterpret_cast<const Simhash::hash_t *>(
+      section(0, header.size));
+  run->ids = reinterpret_cast<const uint64_t *>(section(1, header.size));
+  for (size_t i = 0; i < header.tables; ++i)
+  {
+    run->tables.push_back(reinterpret_cast<const Simhash::hash_t *>(
+        section(2 + i, header.distinct)));
+  }
+  run->file = file;
+
+  if (run->size > 0)
+  {
+    state->runs.push_back(run);
+  }
+  state->next_id = header.next_id;
+  return Simhash::Index(std::move(state));
+}
+
+void Simhash::Index::save(const std::string &path) const
+{
+  State &state = *state_;
+
+  // Take a snapshot of the runs, with a copy of the buffer as the last one
+  std::vector<run_ptr> snapshot;
+  std::vector<const run_t *> inputs;
+  uint64_t next_id;
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    snapshot = state.runs;
+    if (state.buffer.size > 0)
+    {
+      auto buffer = std::make_shared<run_t>(state.buffer);
+      buffer->adopt();
+      snapshot.push_back(buffer);
+    }
+    next_id = state.next_id;
+  }
+  for (const run_ptr &run : snapshot)
+  {
+    inputs.push_back(run.get());
+  }
+  run_ptr run = snapshot.size() == 1 ? snapshot.front() : state.merge(inputs);
+
+  index_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.version = INDEX_VERSION;
+  header.byte_order = INDEX_BYTE_ORDER;
+  header.number_of_blocks = static_cast<uint32_t>(state.number_of_blocks);
+  header.different_bits = static_cast<uint32_t>(state.different_bits);
+  header.tables = static_cast<uint32_t>(state.permutations.size());
+  header.alignment = static_cast<uint32_t>(INDEX_ALIGNMENT);
+  header.size = run->size;
+  header.distinct = run->distinct;
+  header.next_id = next_id;
+
+  std::vector<uint64_t> masks;
+  for (const Simhash::Permutation &permutation : state.permutations)
+  {
+    masks.insert(masks.end(), permutation.masks().begin(),
+                 permutation.masks().end());
+  }
+
+  // Lay out the sections, each starting on a page boundary
+  std::vector<const char *> sources;
+  std::vector<uint64_t> lengths;
+  sources.push_back(reinterpret_cast<const char *>(run->hashes));
+  lengths.push_back(run->size * sizeof(Simhash::hash_t));
+  sources.push_back(reinterpret_cast<const char *>(run->ids));
+  lengths.push_back(run->size * sizeof(uint64_t));
+  for (const Simhash::hash_t *table : run->tables)
+  {
+    sources.push_back(reinterpret_cast<const char *>(table));
+    lengths.push_back(run->distinct * sizeof(Simhash::hash_t));
+  }
+
+  std::vector<uint64_t> offsets;
+  uint64_t offset = sizeof(header) + (masks.size() + sources.size()) *
+                                         sizeof(uint64_t);
+  for (uint64_t length : lengths)
+  {
+    offset = align(offset);
+    offsets.push_back(offset);
+    offset += length;
+  }
+
+  std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(masks.data()),
+            masks.size() * sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(offsets.data()),
+            offsets.size() * sizeof(uint64_t));
+
+  const std::vector<char> padding(INDEX_ALIGNMENT, 0);
+  uint64_t position = sizeof(header) + (masks.size() + offsets.size()) *
+                                           sizeof(uint64_t);
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+    out.write(padding.data(), offsets[i] - position);
+    out.write(sources[i], lengths[i]);
+    position = offsets[i] + lengths[i];
+  }
+
+  out.flush();
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+}
+
+uint64_t Simhash::Index::insert(Simhash::hash_t hash)
+{
+  State &state = *state_;
+  std::lock_guard<std::mutex> lock(state.mutex);
+  run_t &buffer = state.buffer;
+  uint64_t id = state.next_id++;
+
+  // New ids are the largest, so they go after any ids of the same hash
+  auto it = std::upper_bound(buffer.owned_hashes.begin(),
+                             buffer.owned_hashes.end(), hash);
+  size_t position = it - buffer.owned_hashes.begin();
+  bool repeat = position > 0 && buffer.owned_hashes[position - 1] == hash;
+  buffer.owned_hashes.insert(it, hash);
+  buffer.owned_ids.insert(buffer.owned_ids.begin() + position, id);
+
+  if (!repeat)
+  {
+    for (size_t i = 0; i < state.permutations.size(); ++i)
+    {
+      std::vector<Simhash::hash_t> &table = buffer.owned_tables[i];
+      Simhash::hash_t permuted = state.permutations[i].apply(hash);
+      table.insert(std::lower_bound(table.begin(), table.end(), permuted),
+                   permuted);
+    }
+  }
+  buffer.adopt();
+
+  if (buffer.size >= BUFFER_CAPACITY)
+  {
+    state.flush();
+  }
+  return id;
+}
+
+void Simhash::Index::flush()
+{
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  state_->flush();
+}
+
+std::vector<Simhash::hash_t> Simhash::Index::find(Simhash::hash_t query) const
+{
+  State &state = *state_;
+  std::vector<Simhash::hash_t> results;
+  std::vector<run_ptr> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    snapshot = state.runs;
+    state.search(state.buffer, query, results);
+  }
+  for (const run_ptr &run : snapshot)
+  {
+    state.search(*run, query, results);
+  }
+
+  // A match may be found in more than one table, and in more than one run
+  std::sort(results.begin(), results.end());
+  results.erase(std::unique(results.begin(), results.end()), results.end());
+  return results;
+}
+
+std::vector<uint64_t> Simhash::Index::find_ids(Simhash::hash_t query) const
+{
+  State &state = *state_;
+  std::vector<uint64_t> results;
+  std::vector<run_ptr> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    snapshot = state.runs;
+    state.search_ids(state.buffer, query, results);
+  }
+  for (const run_ptr &run : snapshot)
+  {
+    state.search_ids(*run, query, results);
+  }
+  std::sort(results.begin(), results.end());
+  return results;
+}
+
+Simhash::matches_t Simhash::Index::find_between(
+    const std::unordered_set<Simhash::hash_t> &batch,
+    Simhash::ProgressMode progress) const
+{
+  State &state = *state_;
+
+  // Take a snapshot of the runs, with a copy of the buffer as the last one
+  std::vector<run_ptr> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    snapshot = state.runs;
+    if (state.buffer.size > 0)
+    {
+      auto buffer = std::make_shared<run_t>(state.buffer);
+      buffer->adopt();
+      snapshot.push_back(buffer);
+    }
+  }
+
+  Simhash::matches_t results;
+  std::vector<Simhash::hash_t> sorted(batch.size());
+  Simhash::Progress reporter(progress);
+  for (size_t i = 0; i < state.permutations.size(); ++i)
+  {
+    const Simhash::Permutation &permutation = state.permutations[i];
+    reporter.begin("find_between", i, state.permutations.size(),
+                   snapshot.size());
+
+    std::transform(batch.begin(), batch.end(), sorted.begin(),
+                   [&permutation](Simhash::hash_t h) -> Simhash::hash_t
+                   { return permutation.apply(h); });
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<Simhash::match_t> matches;
+    for (const run_ptr &run : snapshot)
+    {
+      state.join(*run, i, sorted, matches);
+      reporter.advance(1);
+    }
+    results.insert(matches.begin(), matches.end());
+    reporter.end();
+  }
+  return results;
+}
+
+size_t Simhash::Index::size() const
+{
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  size_t result = state_->buffer.size;
+  for (const run_ptr &run : state_->runs)
+  {
+    result += run->size;
+  }
+  return result;
+}
+
+size_t Simhash::Index::runs() const
+{
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->runs.size();
+}
+
+size_t Simhash::Index::number_of_blocks() const
+{
+  return state_->number_of_blocks;
+}
+
+size_t Simhash::Index::different_bits() const
+{
+  return state_->different_bits;
+}
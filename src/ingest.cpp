@@ -0,0 +1,566 @@
+#include "../include/ingest.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <stdint.h>
+#include <thread>
+
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/decompress.h"
+#include "../include/jenkins.h"
+#include "../include/json.hh"
+#include "../include/json_fields.h"
+#include "../include/mapped_file.h"
+
+namespace
+{
+const char FINGERPRINT_MAGIC[8] = {'S', 'I', 'M', 'H', 'F', 'P', 'R', '\0'};
+const uint32_t FINGERPRINT_VERSION = 1;
+const uint32_t FINGERPRINT_BYTE_ORDER = 0x01020304;
+
+/**
+ * The fixed header of a fingerprint file, followed by `records` hashes and,
+ * if `blob` is not zero, `records + 1` offsets and `blob` bytes of ids.
+ */
+struct fingerprint_header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t records;
+  uint64_t blob;
+};
+
+// The most digits that always fit in a hash.
+const ptrdiff_t MAX_HASH_DIGITS = 19;
+
+/**
+ * The records parsed from one chunk, in input order.
+ */
+struct batch_t
+{
+  std::vector<Simhash::hash_t> records;
+  Simhash::IdTable ids;
+  size_t lines = 0;
+};
+
+/**
+ * The buffers reused across the lines of a chunk, so that parsing a line
+ * allocates nothing once they have grown.
+ */
+struct scratch_t
+{
+  std::string text;
+  std::string id;
+  Simhash::jenkins hasher;
+  std::vector<Simhash::hash_t> features;
+};
+
+// Read the next chunk of whole lines into `chunk`, keeping any partial line
+// in `carry` for the next call. Returns false once the stream is exhausted.
+bool read_chunk(std::istream &stream, std::string &carry, std::string &chunk)
+{
+  chunk.swap(carry);
+  carry.clear();
+  while (stream.good())
+  {
+    size_t size = chunk.size();
+    chunk.resize(size + Simhash::INGEST_CHUNK);
+    stream.read(&chunk[size], Simhash::INGEST_CHUNK);
+    chunk.resize(size + stream.gcount());
+
+    // Cut after the last newline, or keep reading if a line is this long
+    size_t newline = chunk.rfind('\n');
+    if (newline != std::string::npos)
+    {
+      carry.assign(chunk, newline + 1, std::string::npos);
+      chunk.resize(newline + 1);
+      return true;
+    }
+  }
+  return !chunk.empty();
+}
+
+// Read up to `count` chunks.
+void read_batch(std::istream &stream, std::string &carry, size_t count,
+                std::vector<std::string> &chunks)
+{
+  chunks.resize(count);
+  size_t read = 0;
+  while (read < count && read_chunk(stream, carry, chunks[read]))
+  {
+    ++read;
+  }
+  chunks.resize(read);
+}
+
+// Parse the decimal hash [begin, end) as strtoull would. Plain digits are
+// converted in place; signs, leading spaces and numbers that could overflow
+// are left to strtoull.
+Simhash::hash_t parse_hash(const char *begin, const char *end)
+{
+  Simhash::hash_t value(0);
+  const char *it = begin;
+  while (it < end && it - begin < MAX_HASH_DIGITS && *it >= '0' && *it <= '9')
+  {
+    value = value * 10 + (*it - '0');
+    ++it;
+  }
+  if (it == end || (it > begin && (*it < '0' || *it > '9')))
+  {
+    return value;
+  }
+  if (it == begin && !std::isspace(static_cast<unsigned char>(*it)) &&
+      *it != '+' && *it != '-')
+  {
+    return 0;
+  }
+  return strtoull(std::string(begin, end).c_str(), nullptr, 10);
+}
+
+// Parse and fingerprint the line [begin, end) into `batch`.
+void parse_line(const char *begin, const char *end,
+                const Simhash::ReadOptions &options, size_t window_size,
+                scratch_t &scratch, batch_t &batch)
+{
+  if (options.format == Simhash::InputFormat::hash)
+  {
+    // The id runs up to the first tab, and the hash up to the next one
+    const char *tab =
+        static_cast<const char *>(std::memchr(begin, '\t', end - begin));
+    const char *hash = tab == nullptr ? end : tab + 1;
+    const char *hash_end =
+        static_cast<const char *>(std::memchr(hash, '\t', end - hash));
+    batch.records.push_back(
+        parse_hash(hash, hash_end == nullptr ? end : hash_end));
+    batch.ids.push_back(begin, tab == nullptr ? end : tab);
+    return;
+  }
+
+  // Scan for the two fields, and only parse the whole line if that fails
+  std::string &text = scratch.text;
+  std::string &id = scratch.id;
+  if (!Simhash::extract_fields(begin, end, options.text_column,
+                               options.id_column, text, id))
+  {
+    auto j3 = nlohmann::json::parse(begin, end);
+    text = j3[options.text_column].get<std::string>();
+
+    // Keep the id as it is typed: strings as they are, integers in full
+    const nlohmann::json &value = j3[options.id_column];
+    if (value.is_string())
+    {
+      id = value.get<std::string>();
+    }
+    else if (value.is_number_unsigned())
+    {
+      id = std::to_string(value.get<uint64_t>());
+    }
+    else if (value.is_number_integer())
+    {
+      id = std::to_string(value.get<int64_t>());
+    }
+    else if (value.is_null())
+    {
+      throw std::invalid_argument("Record without " + options.id_column);
+    }
+    else
+    {
+      id = value.dump();
+    }
+  }
+
+  std::vector<Simhash::hash_t> &features = scratch.features;
+  features.clear();
+  for (size_t i = 0; i + window_size < text.size(); i++)
+  {
+    features.push_back(
+        scratch.hasher.compute(text.data() + i, window_size, 0));
+  }
+  batch.records.push_back(Simhash::compute(features));
+  batch.ids.push_back(id.data(), id.data() + id.size());
+}
+
+// Parse and fingerprint every line of [begin, end) into `batch`.
+void parse_chunk(const char *begin, const char *end,
+                 const Simhash::ReadOptions &options, batch_t &batch)
+{
+  size_t window_size = options.window > 0 ? options.window : 5;
+  scratch_t scratch;
+  while (begin < end)
+  {
+    const char *newline =
+        static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+    const char *stop = newline == nullptr ? end : newline;
+    if (stop > begin)
+    {
+      parse_line(begin, stop, options, window_size, scratch, batch);
+      ++batch.lines;
+    }
+    begin = stop + 1;
+  }
+}
+
+// Read the fingerprint file mapped in `file`, up to the sample.
+size_t read_fingerprints(const Simhash::MappedFile &file,
+                         const std::string &path,
+                         const Simhash::ReadOptions &options,
+                         std::vector<Simhash::hash_t> &records,
+                         Simhash::IdTable &ids)
+{
+  fingerprint_header_t header;
+  if (file.size() < sizeof(header))
+  {
+    throw std::runtime_error("Invalid fingerprint file " + path);
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, FINGERPRINT_MAGIC,
+                  sizeof(FINGERPRINT_MAGIC)) != 0 ||
+      header.version != FINGERPRINT_VERSION ||
+      header.byte_order != FINGERPRINT_BYTE_ORDER)
+  {
+    throw std::runtime_error("Invalid fingerprint file " + path);
+  }
+  // Compare in words, so that no count from the file can overflow; the ids
+  // take one more word than the records for the offsets, then the blob
+  uint64_t words = (file.size() - sizeof(header)) / sizeof(uint64_t);
+  bool fits = header.records <= words;
+  if (fits && header.blob > 0)
+  {
+    fits = header.records < words - header.records &&
+           header.blob <= file.size() - sizeof(header) -
+                              (2 * header.records + 1) * sizeof(uint64_t);
+  }
+  if (!fits)
+  {
+    throw std::runtime_error("Invalid fingerprint file " + path +
+                             ": truncated");
+  }
+
+  size_t count = header.records;
+  if (options.sample > 0)
+  {
+    count = std::min(count, options.sample);
+  }
+  const Simhash::hash_t *hashes =
+      reinterpret_cast<const Simhash::hash_t *>(file.data() + sizeof(header));
+  records.insert(records.end(), hashes, hashes + count);
+
+  // The offsets must run from the start to the end of the blob in order
+  const uint64_t *offsets =
+      reinterpret_cast<const uint64_t *>(hashes + header.records);
+  const char *blob =
+      reinterpret_cast<const char *>(offsets + header.records + 1);
+  if (header.blob > 0)
+  {
+    bool ordered = offsets[0] == 0 && offsets[header.records] == header.blob;
+#pragma omp parallel for schedule(static) reduction(&& : ordered)
+    for (size_t r = 0; r < header.records; ++r)
+    {
+      ordered = ordered && offsets[r] <= offsets[r + 1];
+    }
+    if (!ordered)
+    {
+      throw std::runtime_error("Invalid fingerprint file " + path +
+                               ": bad id offsets");
+    }
+  }
+
+  // Intern the ids of contiguous ranges in parallel, then append them
+  std::vector<Simhash::IdTable> ranges(omp_get_max_threads());
+#pragma omp parallel for schedule(static, 1)
+  for (size_t k = 0; k < ranges.size(); ++k)
+  {
+    for (size_t r = count * k / ranges.size();
+         r < count * (k + 1) / ranges.size(); ++r)
+    {
+      if (header.blob > 0)
+      {
+        ranges[k].push_back(blob + offsets[r], blob + offsets[r + 1]);
+      }
+      else
+      {
+        ranges[k].push_back(static_cast<uint64_t>(r));
+      }
+    }
+  }
+  ids.reserve(ids.size() + count);
+  for (const Simhash::IdTable &range : ranges)
+  {
+    ids.append(range, range.size());
+  }
+  return count;
+}
+
+// Parse the chunks [starts[c], ends[c]) in parallel, each into its own batch,
+// rethrowing the first error once they are all done.
+void parse_chunks(const std::vector<const char *> &starts,
+                  const std::vector<const char *> &ends,
+                  const Simhash::ReadOptions &options,
+                  std::vector<batch_t> &batches)
+{
+  batches.clear();
+  batches.resize(starts.size());
+  std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t c = 0; c < starts.size(); ++c)
+  {
+    try
+    {
+      parse_chunk(starts[c], ends[c], options, batches[c]);
+    }
+    catch (...)
+    {
+#pragma omp critical
+      if (!error)
+      {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+}
+
+// Append the batches in order, up to the sample, returning whether the
+// sample is full.
+bool append_batches(std::vector<batch_t> &batches,
+                    const Simhash::ReadOptions &options,
+                    std::vector<Simhash::hash_t> &records,
+                    Simhash::IdTable &ids, size_t &lines)
+{
+  for (batch_t &batch : batches)
+  {
+    size_t take = batch.records.size();
+    if (options.sample > 0)
+    {
+      take = std::min(take, options.sample - records.size());
+    }
+    records.insert(records.end(), batch.records.begin(),
+                   batch.records.begin() + take);
+    ids.append(batch.ids, take);
+    lines += take < batch.records.size() ? take : batch.lines;
+    if (options.sample > 0 && records.size() == options.sample)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+} // namespace
+
+Simhash::InputFormat Simhash::parse_input_format(const std::string &name)
+{
+  if (name == "hash")
+  {
+    return Simhash::InputFormat::hash;
+  }
+  if (name == "json")
+  {
+    return Simhash::InputFormat::json;
+  }
+  if (name == "binary")
+  {
+    return Simhash::InputFormat::binary;
+  }
+  throw std::invalid_argument("Unknown input format: " + name);
+}
+
+size_t Simhash::read_records(std::istream &stream,
+                             const Simhash::ReadOptions &options,
+                             std::vector<Simhash::hash_t> &records,
+                             Simhash::IdTable &ids)
+{
+  if (options.format == Simhash::InputFormat::binary)
+  {
+    throw std::invalid_argument("Fingerprint files must be read from a path");
+  }
+
+  // Skip the first line in the tsv file, assuming it is the header
+  if (options.format == Simhash::InputFormat::hash)
+  {
+    std::string header;
+    std::getline(stream, header);
+  }
+
+  size_t batch_size = 2 * omp_get_max_threads();
+  size_t lines = 0;
+  std::string carry;
+  std::vector<std::string> current, next;
+  read_batch(stream, carry, batch_size, current);
+
+  std::vector<const char *> starts, ends;
+  std::vector<batch_t> batches;
+  while (!current.empty())
+  {
+    // Read the next batch while this one is parsed
+    std::thread reader(&read_batch, std::ref(stream), std::ref(carry),
+                       batch_size, std::ref(next));
+
+    starts.clear();
+    ends.clear();
+    for (const std::string &chunk : current)
+    {
+      starts.push_back(chunk.data());
+      ends.push_back(chunk.data() + chunk.size());
+    }
+    try
+    {
+      parse_chunks(starts, ends, options, batches);
+    }
+    catch (...)
+    {
+      reader.join();
+      throw;
+    }
+    reader.join();
+
+    if (append_batches(batches, options, records, ids, lines))
+    {
+      break;
+    }
+    current.swap(next);
+  }
+  return lines;
+}
+
+size_t Simhash::read_records(const std::string &path,
+                             const Simhash::ReadOptions &options,
+                             std::vector<Simhash::hash_t> &records,
+                             Simhash::IdTable &ids)
+{
+  // Pipes and other special files cannot be mapped, so they are streamed
+  struct stat st;
+  if (::stat(path.c_str(), &st) == 0 && !S_ISREG(st.st_mode))
+  {
+    std::ifstream stream(path, std::ifstream::in | std::ifstream::binary);
+    if (!stream.good())
+    {
+      throw std::runtime_error("Error reading " + path);
+    }
+    return read_records(stream, options, records, ids);
+  }
+
+  // Compressed files are decoded on their own thread and streamed
+  Simhash::Compression compression = Simhash::detect_compression(path);
+  if (compression != Simhash::Compression::none)
+  {
+    if (options.format == Simhash::InputFormat::binary)
+    {
+      throw std::runtime_error("Fingerprint files cannot be compressed: " +
+                               path);
+    }
+    Simhash::DecompressedStream stream(path, compression);
+    size_t lines = read_records(stream, options, records, ids);
+    stream.check();
+    return lines;
+  }
+
+  Simhash::MappedFile file(path);
+  file.advise(MADV_SEQUENTIAL);
+  if (options.format == Simhash::InputFormat::binary)
+  {
+    return read_fingerprints(file, path, options, records, ids);
+  }
+  const char *begin = file.data();
+  const char *end = begin + file.size();
+
+  // Skip the first line in the tsv file, assuming it is the header
+  if (options.format == Simhash::InputFormat::hash && begin < end)
+  {
+    const char *newline =
+        static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+    begin = newline == nullptr ? end : newline + 1;
+  }
+
+  // Cut the mapping into chunks, each moved forward to a line boundary, and
+  // parse them in place a batch at a time, so a sample stops early
+  size_t batch_size = 2 * omp_get_max_threads();
+  size_t lines = 0;
+  std::vector<const char *> starts, ends;
+  std::vector<batch_t> batches;
+  while (begin < end)
+  {
+    starts.clear();
+    ends.clear();
+    while (begin < end && starts.size() < batch_size)
+    {
+      const char *stop = end;
+      if (static_cast<size_t>(end - begin) > Simhash::INGEST_CHUNK)
+      {
+        const char *cut = begin + Simhash::INGEST_CHUNK;
+        const char *newline =
+            static_cast<const char *>(std::memchr(cut, '\n', end - cut));
+        stop = newline == nullptr ? end : newline + 1;
+      }
+      starts.push_back(begin);
+      ends.push_back(stop);
+      begin = stop;
+    }
+
+    parse_chunks(starts, ends, options, batches);
+    if (append_batches(batches, options, records, ids, lines))
+    {
+      break;
+    }
+  }
+  return lines;
+}
+
+void Simhash::write_fingerprints(const std::string &path,
+                                 const std::vector<Simhash::hash_t> &records,
+                                 const Simhash::IdTable &ids)
+{
+  if (ids.size() > 0 && ids.size() != records.size())
+  {
+    throw std::invalid_argument("Every record must have an id, or none");
+  }
+
+  std::vector<uint64_t> offsets(1, 0);
+  offsets.reserve(ids.size() + 1);
+  std::string blob;
+  for (size_t i = 0; i < ids.size(); ++i)
+  {
+    ids.append_to(blob, i);
+    offsets.push_back(blob.size());
+  }
+
+  fingerprint_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, FINGERPRINT_MAGIC, sizeof(FINGERPRINT_MAGIC));
+  header.version = FINGERPRINT_VERSION;
+  header.byte_order = FINGERPRINT_BYTE_ORDER;
+  header.records = records.size();
+  header.blob = offsets.back();
+
+  std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(records.data()),
+            records.size() * sizeof(Simhash::hash_t));
+  if (header.blob > 0)
+  {
+    out.write(reinterpret_cast<const char *>(offsets.data()),
+              offsets.size() * sizeof(uint64_t));
+    out.write(blob.data(), blob.size());
+  }
+  out.flush();
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+}
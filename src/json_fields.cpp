@@ -0,0 +1,357 @@
+#include "../include/json_fields.h"
+
+#include <cstring>
+#include <stdint.h>
+
+namespace
+{
+const char *skip_whitespace(const char *it, const char *end)
+{
+  while (it < end && (*it == ' ' || *it == '\t' || *it == '\n' || *it == '\r'))
+  {
+    ++it;
+  }
+  return it;
+}
+
+// The closing quote of the string whose contents start at `it`, or `end`.
+// `escaped` is set if the string has any escape sequences.
+const char *string_end(const char *it, const char *end, bool &escaped)
+{
+  escaped = false;
+  while (it < end)
+  {
+    const char *quote =
+        static_cast<const char *>(std::memchr(it, '"', end - it));
+    if (quote == nullptr)
+    {
+      return end;
+    }
+    const char *slash =
+        static_cast<const char *>(std::memchr(it, '\\', quote - it));
+    if (slash == nullptr)
+    {
+      return quote;
+    }
+    // Step over the escaped character, which may itself be a quote
+    escaped = true;
+    it = slash + 2;
+  }
+  return end;
+}
+
+int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F')
+  {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Read the four hex digits of a \u escape starting at `it`.
+bool read_code_unit(const char *it, const char *end, uint32_t &unit)
+{
+  if (end - it < 4)
+  {
+    return false;
+  }
+  unit = 0;
+  for (int k = 0; k < 4; ++k)
+  {
+    int digit = hex_digit(it[k]);
+    if (digit < 0)
+    {
+      return false;
+    }
+    unit = (unit << 4) | digit;
+  }
+  return true;
+}
+
+void append_utf8(uint32_t code_point, std::string &out)
+{
+  if (code_point < 0x80)
+  {
+    out.push_back(static_cast<char>(code_point));
+  }
+  else if (code_point < 0x800)
+  {
+    out.push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  }
+  else if (code_point < 0x10000)
+  {
+    out.push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  }
+  else
+  {
+    out.push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  }
+}
+
+// Decode the escaped string contents [it, end) into `out`.
+bool unescape(const char *it, const char *end, std::string &out)
+{
+  out.clear();
+  while (it < end)
+  {
+    const char *slash =
+        static_cast<const char *>(std::memchr(it, '\\', end - it));
+    if (slash == nullptr)
+    {
+      out.append(it, end);
+      return true;
+    }
+    out.append(it, slash);
+    if (end - slash < 2)
+    {
+      return false;
+    }
+    it = slash + 2;
+    switch (slash[1])
+    {
+    case '"':
+    case '\\':
+    case '/':
+      out.push_back(slash[1]);
+      break;
+    case 'b':
+      out.push_back('\b');
+      break;
+    case 'f':
+      out.push_back('\f');
+      break;
+    case 'n':
+      out.push_back('\n');
+      break;
+    case 'r':
+      out.push_back('\r');
+      break;
+    case 't':
+      out.push_back('\t');
+      break;
+    case 'u':
+    {
+      uint32_t unit;
+      if (!read_code_unit(it, end, unit))
+      {
+        return false;
+      }
+      it += 4;
+      if (unit >= 0xD800 && unit < 0xDC00)
+      {
+        // A high surrogate must be followed by an escaped low surrogate
+        uint32_t low;
+        if (end - it < 6 || it[0] != '\\' || it[1] != 'u' ||
+            !read_code_unit(it + 2, end, low) || low < 0xDC00 ||
+            low >= 0xE000)
+        {
+          return false;
+        }
+        it += 6;
+        unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+      }
+      else if (unit >= 0xDC00 && unit < 0xE000)
+      {
+        return false;
+      }
+      append_utf8(unit, out);
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copy the string starting at the quote `it` into `out`, decoding escapes
+// if it has any. Returns the position after the closing quote, or nullptr if
+// it is malformed.
+const char *read_string(const char *it, const char *end, std::string &out)
+{
+  bool escaped;
+  const char *close = string_end(it + 1, end, escaped);
+  if (close == end)
+  {
+    return nullptr;
+  }
+  if (!escaped)
+  {
+    out.assign(it + 1, close);
+  }
+  else if (!unescape(it + 1, close, out))
+  {
+    return nullptr;
+  }
+  return close + 1;
+}
+
+// Skip over the value starting at `it`, returning the position after it, or
+// nullptr if it is malformed. Nested values are only checked for balance.
+const char *skip_value(const char *it, const char *end)
+{
+  bool escaped;
+  if (*it == '"')
+  {
+    const char *close = string_end(it + 1, end, escaped);
+    return close < end ? close + 1 : nullptr;
+  }
+  if (*it == '{' || *it == '[')
+  {
+    size_t depth = 0;
+    while (it < end)
+    {
+      if (*it == '"')
+      {
+        it = string_end(it + 1, end, escaped);
+        if (it == end)
+        {
+          return nullptr;
+        }
+      }
+      else if (*it == '{' || *it == '[')
+      {
+        ++depth;
+      }
+      else if (*it == '}' || *it == ']')
+      {
+        if (--depth == 0)
+        {
+          return it + 1;
+        }
+      }
+      ++it;
+    }
+    return nullptr;
+  }
+  // A number or a literal runs up to the next delimiter
+  const char *start = it;
+  while (it < end && *it != ',' && *it != '}' && *it != ' ' && *it != '\t' &&
+         *it != '\n' && *it != '\r')
+  {
+    ++it;
+  }
+  return it > start ? it : nullptr;
+}
+} // namespace
+
+bool Simhash::extract_fields(const char *begin, const char *end,
+                             const std::string &text_key,
+                             const std::string &id_key, std::string &text,
+                             std::string &id)
+{
+  bool found_text = false, found_id = false;
+  bool escaped;
+
+  const char *it = skip_whitespace(begin, end);
+  if (it == end || *it != '{')
+  {
+    return false;
+  }
+  it = skip_whitespace(it + 1, end);
+
+  while (it < end && *it == '"')
+  {
+    // Keys are compared raw, so escaped keys are left to the full parser
+    const char *key = it + 1;
+    const char *key_end = string_end(key, end, escaped);
+    if (key_end == end || escaped)
+    {
+      return false;
+    }
+    size_t key_size = key_end - key;
+
+    it = skip_whitespace(key_end + 1, end);
+    if (it == end || *it != ':')
+    {
+      return false;
+    }
+    it = skip_whitespace(it + 1, end);
+    if (it == end)
+    {
+      return false;
+    }
+
+    if (key_size == text_key.size() &&
+        std::memcmp(key, text_key.data(), key_size) == 0)
+    {
+      it = *it == '"' ? read_string(it, end, text) : nullptr;
+      if (it == nullptr)
+      {
+        return false;
+      }
+      found_text = true;
+    }
+    else if (key_size == id_key.size() &&
+             std::memcmp(key, id_key.data(), key_size) == 0)
+    {
+      if (*it == '"')
+      {
+        it = read_string(it, end, id);
+        if (it == nullptr)
+        {
+          return false;
+        }
+      }
+      else
+      {
+        // Only plain integers, which print back exactly as they are written
+        const char *digits = it;
+        if (*it == '-')
+        {
+          ++it;
+        }
+        const char *first = it;
+        while (it < end && *it >= '0' && *it <= '9')
+        {
+          ++it;
+        }
+        size_t count = it - first;
+        if (count == 0 || (*first == '0' && count > 1) ||
+            (it < end && (*it == '.' || *it == 'e' || *it == 'E')) ||
+            (*digits == '-' && count == 1 && *first == '0'))
+        {
+          return false;
+        }
+        id.assign(digits, it);
+      }
+      found_id = true;
+    }
+    else
+    {
+      it = skip_value(it, end);
+      if (it == nullptr)
+      {
+        return false;
+      }
+    }
+
+    if (found_text && found_id)
+    {
+      return true;
+    }
+
+    it = skip_whitespace(it, end);
+    if (it == end || *it != ',')
+    {
+      return false;
+    }
+    it = skip_whitespace(it + 1, end);
+  }
+  return false;
+}
@@ -1,14 +1,17 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <map>
 #include <sstream>
 #include <thread>
-#include <unordered_set>
+#include <vector>
 
 #include <getopt.h>
+#include <omp.h>
 
-#include "../include/jenkins.h"
-#include "../include/json.hh"
+#include "../include/clustering.h"
+#include "../include/graph.h"
+#include "../include/ingest.h"
+#include "../include/output.h"
 #include "../include/simhash.h"
 
 void usage(int argc, char **argv)
@@ -21,136 +24,298 @@ void usage(int argc, char **argv)
             << " [--id_column=ID]"
             << " [--sample=SAMPLE]"
             << " [--window=WINDOW]"
+            << " [--progress=MODE]"
+            << " [--graph GRAPH]"
+            << " [--clustering=ENGINE]"
+            << " [--state STATE]"
+            << " [--representative=MODE]"
+            << " [--output_format=FORMAT]"
+            << " [--pairs [--distances]]"
             << " --output OUTPUT\n\n"
             << "Read simhashes or json lines from input, find all pairs within "
                "distance bits of \n"
             << "each other, writing them to output.\n\n"
             << "  --blocks BLOCKS        Number of bit blocks to use\n"
             << "  --distance DISTANCE    Maximum bit distances of matches\n"
-            << "  --input INPUT          Path to input ('-' for stdin)\n"
-            << "  --format               Format of the input, hash or json\n"
+            << "  --input INPUT          Path to input ('-' for stdin), may "
+               "be gzip or zstd compressed\n"
+            << "  --format               Format of the input, hash, json or "
+               "binary\n"
             << "  --text_column          Column of the text to hash, optional\n"
-            << "  --id_column            Column of the index, optional\n"
+            << "  --id_column            Column of the id, an integer or a "
+               "string, optional\n"
             << "  --sample               Number of samples to take from the "
                "input, optional\n"
             << "  --window               Size of the hashing window, optional\n"
-            << "  --output OUTPUT        Path to output ('-' for stdout)\n";
+            << "  --progress             Progress reporting, bar (default), "
+               "quiet or json, optional\n"
+            << "  --graph GRAPH          Path to write the match graph to, in "
+               "binary CSR form, optional\n"
+            << "  --clustering           Clustering engine, union_find "
+               "(default), components or leader, optional\n"
+            << "  --state STATE          Path to the cluster state to update "
+               "incrementally, optional\n"
+            << "  --representative       Add the representative hash of each "
+               "cluster, medoid or most_ids, optional\n"
+            << "  --output_format        Format of the output, tsv (default) "
+               "or binary, optional\n"
+            << "  --pairs                Write the matching pairs of hashes "
+               "instead of clusters,\n"
+            << "                         optional\n"
+            << "  --distances            Add the distance of each pair, "
+               "optional\n"
+            << "  --output OUTPUT        Path to output ('-' for stdout)\n\n"
+            << "usage: " << argv[0] << " convert"
+            << " --input INPUT"
+            << " --format FORMAT"
+            << " [--text_column=TEXT]"
+            << " [--id_column=ID]"
+            << " [--sample=SAMPLE]"
+            << " [--window=WINDOW]"
+            << " --output OUTPUT\n\n"
+            << "Read hashes or json lines from input and write their "
+               "fingerprints and ids to\n"
+            << "output as a binary fingerprint file, to be read with "
+               "--format binary.\n";
 }
 
 /*
-
-1. Read hashes or json lines from the input and create hashes if it is json;
-2. Store the hashes in the first argument `hashes`;
-3. Store the hash-to-indices mapping in the second argument `hash2ids`;
-
-If it is in json format:
-1. Tokenize the text from the `text_column` with the `window` size;
-2. Hash each token individually and compute the document fingerprint;
-
-Only takes the first `sample` records if `sample` is larger than zero.
-*/
-void read_hashes(
-    std::istream &stream, std::unordered_set<Simhash::hash_t> &hashes,
-    std::map<Simhash::hash_t, std::unordered_set<std::string>> &hash2ids,
-    std::string text_column, std::string id_column, std::string format,
-    size_t sample, size_t window)
+Convert the input to a binary fingerprint file, returning the exit code.
+ */
+int convert(int argc, char **argv)
 {
-  Simhash::hash_t hash(0);
-  Simhash::jenkins hasher;
+  std::string input, output, text_column, id_column, format;
+  size_t sample(0), window(0);
 
-  int count = 0;
-  int limit = static_cast<int>(sample);
-  int window_size = window > 0 ? static_cast<int>(window) : 5;
+  int getopt_return_value(0);
+  while (getopt_return_value != -1)
+  {
+    int option_index = 0;
+    static struct option long_options[] = {
+        {"input", required_argument, 0, 0},
+        {"text_column", required_argument, 0, 0},
+        {"id_column", required_argument, 0, 0},
+        {"output", required_argument, 0, 0},
+        {"format", required_argument, 0, 0},
+        {"sample", required_argument, 0, 0},
+        {"window", required_argument, 0, 0},
+        {"help", no_argument, 0, 0},
+        {0, 0, 0, 0}};
 
-  std::string line;
+    getopt_return_value = getopt_long(argc, argv, "i:t:x:o:f:n:w:h", long_options, &option_index);
 
-  while (!stream.eof() && (limit > 0 ? (format == "hash" ? (count - 1 < limit) : (count < limit)) : true))
-  {
-    std::getline(stream, line);
-    if (stream.fail())
+    switch (getopt_return_value)
     {
+    case 0:
+      switch (option_index)
+      {
+      case 0:
+        input = optarg;
+        break;
+      case 1:
+        text_column = optarg;
+        break;
+      case 2:
+        id_column = optarg;
+        break;
+      case 3:
+        output = optarg;
+        break;
+      case 4:
+        format = optarg;
+        break;
+      case 5:
+        std::stringstream(std::string(optarg)) >> sample;
+        break;
+      case 6:
+        std::stringstream(std::string(optarg)) >> window;
+        break;
+      case 7:
+        usage(argc, argv);
+        return 0;
+      }
+      break;
+    case 'i':
+      input = optarg;
+      break;
+    case 't':
+      text_column = optarg;
+      break;
+    case 'x':
+      id_column = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'f':
+      format = optarg;
+      break;
+    case 'n':
+      std::stringstream(std::string(optarg)) >> sample;
+      break;
+    case 'w':
+      std::stringstream(std::string(optarg)) >> window;
       break;
+    case 'h':
+      usage(argc, argv);
+      return 0;
+    case '?':
+      return 1;
     }
+  }
 
-    if (format == "hash")
-    {
-      // Skip the first line in the tsv file, assuming it is the header
-      if (count++ == 0)
-      {
-        continue;
-      }
-      std::istringstream iss(line);
-      std::string id, h;
-      char *end;
+  if (input.empty())
+  {
+    std::cerr << "Input must be provided and non-empty." << std::endl;
+    return 4;
+  }
 
-      std::getline(iss, id, '\t');
-      std::getline(iss, h, '\t');
-      hash = strtoull(h.c_str(), &end, 10);
+  if (output.empty())
+  {
+    std::cerr << "Output must be provided and non-empty." << std::endl;
+    return 5;
+  }
 
-      hash2ids[hash].insert(id);
-      hashes.insert(hash);
+  Simhash::ReadOptions read_options;
+  try
+  {
+    read_options.format = Simhash::parse_input_format(format);
+  }
+  catch (const std::invalid_argument &)
+  {
+    std::cerr << "Format must be provided (hash, json or binary) and non-empty."
+              << std::endl;
+    return 7;
+  }
+  read_options.text_column = text_column;
+  read_options.id_column = id_column;
+  read_options.sample = sample;
+  read_options.window = window;
+
+  std::vector<Simhash::hash_t> records;
+  Simhash::IdTable ids;
+  try
+  {
+    if (input.compare("-") == 0)
+    {
+      Simhash::read_records(std::cin, read_options, records, ids);
     }
-    else if (format == "json")
+    else
     {
-      auto j3 = nlohmann::json::parse(line);
-      std::string text = j3[text_column];
-      int index = j3[id_column];
-
-      std::string id = std::to_string(index);
-      std::vector<Simhash::hash_t> features;
-
-      for (int i = 0; i < text.size() - window_size; i++)
-      {
-        std::string token = text.substr(i, window_size);
-        const char *c = token.c_str();
-        features.push_back(hasher.compute(c, token.size(), 0));
-      }
-      Simhash::hash_t hash = Simhash::compute(features);
-      hash2ids[hash].insert(id);
-      hashes.insert(hash);
-      count++;
+      Simhash::read_records(input, read_options, records, ids);
     }
   }
-  std::cout << "Total " << count << " lines and " << hashes.size() << " hashes"
+  catch (const std::exception &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 7;
+  }
+
+  std::cerr << "Writing " << records.size() << " records to " << output
             << std::endl;
+  try
+  {
+    Simhash::write_fingerprints(output, records, ids);
+  }
+  catch (const std::runtime_error &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 15;
+  }
+  return 0;
 }
 
-/* 
-Write the clusters to a tsv file.
- */
-void write_clusters(
-    std::ostream &stream, const Simhash::clusters_t &clusters,
-    std::map<Simhash::hash_t, std::unordered_set<std::string>> &hash2ids)
+/*
+Group the record ids by the dense index of their hash.
+
+The ids of the hash with index `i` end up in `ids[offsets[i]]` up to (not
+including) `ids[offsets[i + 1]]`, in input order. A repeated (id, hash)
+record is only kept once.
+
+Every pass runs in parallel: the counts and the scatter use atomic updates,
+which leave the records of a hash in any order, so each hash with several
+records has them sorted back into input order afterwards.
+*/
+void group_ids(const std::vector<Simhash::index_t> &indices,
+               Simhash::IdTable &ids, size_t size,
+               std::vector<uint64_t> &offsets)
 {
-  std::cout << "Found " << clusters.size() << " clusters" << std::endl;
-  stream << "id\thash\tcluster" << std::endl;
+  offsets.assign(size + 1, 0);
+#pragma omp parallel for schedule(static)
+  for (size_t r = 0; r < indices.size(); ++r)
+  {
+#pragma omp atomic
+    ++offsets[indices[r] + 1];
+  }
 
-  int cluster_id = 0;
-  for (const auto &cluster : clusters)
+  // Prefix sums over one block per thread, then shift each block by the
+  // blocks before it
+  std::vector<uint64_t> sums;
+#pragma omp parallel
   {
-    for (const auto &hash : cluster)
+#pragma omp single
+    sums.assign(omp_get_num_threads() + 1, 0);
+
+    size_t threads = sums.size() - 1;
+    size_t t = omp_get_thread_num();
+    size_t first = 1 + size * t / threads;
+    size_t last = 1 + size * (t + 1) / threads;
+    for (size_t i = first + 1; i < last; ++i)
     {
-      for (const auto &idx : hash2ids[hash])
-      {
-        stream << idx << "\t" << std::to_string(hash) << "\t" << cluster_id
-               << std::endl;
-      }
+      offsets[i] += offsets[i - 1];
+    }
+    sums[t + 1] = first < last ? offsets[last - 1] : 0;
+#pragma omp barrier
+#pragma omp single
+    for (size_t k = 0; k < threads; ++k)
+    {
+      sums[k + 1] += sums[k];
+    }
+    for (size_t i = first; i < last; ++i)
+    {
+      offsets[i] += sums[t];
+    }
+  }
+
+  std::vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+  std::vector<uint64_t> order(indices.size());
+#pragma omp parallel for schedule(static)
+  for (size_t r = 0; r < indices.size(); ++r)
+  {
+    uint64_t slot;
+#pragma omp atomic capture
+    slot = next[indices[r]]++;
+    order[slot] = r;
+  }
+  std::vector<uint64_t>().swap(next);
+
+#pragma omp parallel for schedule(dynamic, 4096)
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (offsets[i + 1] - offsets[i] > 1)
+    {
+      std::sort(order.begin() + offsets[i], order.begin() + offsets[i + 1]);
     }
-    cluster_id++;
   }
-  stream.flush();
+
+  ids.permute(order);
+  ids.deduplicate(offsets);
 }
 
 int main(int argc, char **argv)
 {
-
-  unsigned int n = std::thread::hardware_concurrency();
-  std::cout << n << " concurrent threads are supported.\n";
+  if (argc > 1 && std::string(argv[1]) == "convert")
+  {
+    return convert(argc - 1, argv + 1);
+  }
 
   auto start = std::chrono::high_resolution_clock::now();
 
   std::string input, output, text_column, id_column, format;
+  std::string progress("bar"), graph, clustering, state,
+      representative, output_format("tsv");
   size_t blocks(0), distance(0), sample(0), window(0);
+  bool pairs(false), distances(false);
 
   int getopt_return_value(0);
   while (getopt_return_value != -1)
@@ -158,18 +323,26 @@ int main(int argc, char **argv)
     int option_index = 0;
     static struct option long_options[] = {
         {"input", required_argument, 0, 0},
-        {"text_column", optional_argument, 0, 0},
-        {"id_column", optional_argument, 0, 0},
+        {"text_column", required_argument, 0, 0},
+        {"id_column", required_argument, 0, 0},
         {"output", required_argument, 0, 0},
         {"blocks", required_argument, 0, 0},
         {"distance", required_argument, 0, 0},
         {"help", no_argument, 0, 0},
         {"format", required_argument, 0, 0},
-        {"sample", optional_argument, 0, 0},
-        {"window", optional_argument, 0, 0},
+        {"sample", required_argument, 0, 0},
+        {"window", required_argument, 0, 0},
+        {"progress", required_argument, 0, 0},
+        {"graph", required_argument, 0, 0},
+        {"clustering", required_argument, 0, 0},
+        {"state", required_argument, 0, 0},
+        {"representative", optional_argument, 0, 0},
+        {"output_format", required_argument, 0, 0},
+        {"pairs", no_argument, 0, 0},
+        {"distances", no_argument, 0, 0},
         {0, 0, 0, 0}};
 
-    getopt_return_value = getopt_long(argc, argv, "i:t::x::o:b:d:hf:n::w::", long_options, &option_index);
+    getopt_return_value = getopt_long(argc, argv, "i:t:x:o:b:d:hf:n:w:p:g:c:s:r::F:PD", long_options, &option_index);
 
     switch (getopt_return_value)
     {
@@ -206,6 +379,30 @@ int main(int argc, char **argv)
       case 9:
         std::stringstream(std::string(optarg)) >> window;
         break;
+      case 10:
+        progress = optarg;
+        break;
+      case 11:
+        graph = optarg;
+        break;
+      case 12:
+        clustering = optarg;
+        break;
+      case 13:
+        state = optarg;
+        break;
+      case 14:
+        representative = optarg ? optarg : "medoid";
+        break;
+      case 15:
+        output_format = optarg;
+        break;
+      case 16:
+        pairs = true;
+        break;
+      case 17:
+        distances = true;
+        break;
       }
       break;
     case 'i':
@@ -238,6 +435,30 @@ int main(int argc, char **argv)
     case 'w':
       std::stringstream(std::string(optarg)) >> window;
       break;
+    case 'p':
+      progress = optarg;
+      break;
+    case 'g':
+      graph = optarg;
+      break;
+    case 'c':
+      clustering = optarg;
+      break;
+    case 's':
+      state = optarg;
+      break;
+    case 'r':
+      representative = optarg ? optarg : "medoid";
+      break;
+    case 'F':
+      output_format = optarg;
+      break;
+    case 'P':
+      pairs = true;
+      break;
+    case 'D':
+      distances = true;
+      break;
     case '?':
       return 1;
     }
@@ -274,62 +495,306 @@ int main(int argc, char **argv)
     return 6;
   }
 
-  if (format.empty())
+  // Keep stdout for the results alone when they are written there, and for
+  // pairs, which are usually piped on
+  std::ostream &status =
+      (pairs || output.compare("-") == 0) ? std::cerr : std::cout;
+
+  unsigned int n = std::thread::hardware_concurrency();
+  status << n << " concurrent threads are supported.\n";
+
+  Simhash::ReadOptions read_options;
+  try
+  {
+    read_options.format = Simhash::parse_input_format(format);
+  }
+  catch (const std::invalid_argument &)
   {
-    std::cerr << "Format must be provided (hash or json) and non-empty."
+    std::cerr << "Format must be provided (hash, json or binary) and non-empty."
               << std::endl;
     return 7;
   }
+  read_options.text_column = text_column;
+  read_options.id_column = id_column;
+  read_options.sample = sample;
+  read_options.window = window;
+
+  Simhash::ProgressMode progress_mode;
+  try
+  {
+    progress_mode = Simhash::parse_progress_mode(progress);
+  }
+  catch (const std::invalid_argument &)
+  {
+    std::cerr << "Progress must be bar, quiet or json." << std::endl;
+    return 9;
+  }
+
+  Simhash::ClusterEngine engine(Simhash::ClusterEngine::union_find);
+  if (!clustering.empty())
+  {
+    try
+    {
+      engine = Simhash::parse_cluster_engine(clustering);
+    }
+    catch (const std::invalid_argument &)
+    {
+      std::cerr << "Clustering must be union_find, components or leader." << std::endl;
+      return 12;
+    }
+  }
+  // Pairs are written without clustering, so nothing else would apply
+  if (pairs && (!clustering.empty() || !graph.empty() || !state.empty() ||
+                !representative.empty()))
+  {
+    std::cerr << "Pairs cannot be used with --clustering, --graph, --state "
+                 "or --representative." << std::endl;
+    return 12;
+  }
+  // A saved graph or state is always clustered into connected components
+  if (engine == Simhash::ClusterEngine::leader &&
+      (!graph.empty() || !state.empty()))
+  {
+    std::cerr << "Leader clustering cannot be used with --graph or --state."
+              << std::endl;
+    return 12;
+  }
+
+  Simhash::Representative representative_mode(
+      Simhash::Representative::medoid);
+  if (!representative.empty())
+  {
+    try
+    {
+      representative_mode = Simhash::parse_representative(representative);
+    }
+    catch (const std::invalid_argument &)
+    {
+      std::cerr << "Representative must be medoid or most_ids." << std::endl;
+      return 14;
+    }
+  }
+
+  Simhash::OutputFormat output_mode;
+  try
+  {
+    output_mode = Simhash::parse_output_format(output_format);
+  }
+  catch (const std::invalid_argument &)
+  {
+    std::cerr << "Output format must be tsv or binary." << std::endl;
+    return 16;
+  }
+  if (output_mode == Simhash::OutputFormat::binary &&
+      output.compare("-") == 0)
+  {
+    std::cerr << "Binary output must be written to a file." << std::endl;
+    return 16;
+  }
 
   // Read the input
-  std::unordered_set<Simhash::hash_t> hashes;
-  std::map<Simhash::hash_t, std::unordered_set<std::string>> hash2ids;
+  std::vector<Simhash::hash_t> records;
+  Simhash::IdTable ids;
+  size_t lines(0);
 
   if (input.compare("-") == 0)
   {
     std::cerr << "Reading hashes from stdin." << std::endl;
-    read_hashes(std::cin, hashes, hash2ids, text_column, id_column, format,
-                sample, window);
+    try
+    {
+      lines = Simhash::read_records(std::cin, read_options, records, ids);
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 7;
+    }
   }
   else
   {
     std::cerr << "Reading hashes from " << input << std::endl;
+    try
+    {
+      lines = Simhash::read_records(input, read_options, records, ids);
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 7;
+    }
+  }
+  status << "Total " << lines << " lines and " << records.size()
+         << " records" << std::endl;
+
+  // Give every distinct hash a dense index, and group the ids by it
+  std::vector<Simhash::hash_t> hashes;
+  std::vector<uint64_t> offsets;
+  try
+  {
+    std::vector<Simhash::index_t> indices = Simhash::remap(records, hashes);
+    std::vector<Simhash::hash_t>().swap(records);
+    group_ids(indices, ids, hashes.size(), offsets);
+  }
+  catch (const std::invalid_argument &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 10;
+  }
+  status << "Total " << hashes.size() << " hashes" << std::endl;
+
+  if (pairs)
+  {
+    // Stream the matches straight to the output, without clustering
+    std::cerr << "Writing matches to " << output << std::endl;
+    std::ofstream fout;
+    if (output.compare("-") != 0)
     {
-      std::ifstream fin(input, std::ifstream::in | std::ifstream::binary);
-      if (!fin.good())
+      fout.open(output, std::ofstream::binary);
+      if (!fout.good())
       {
-        std::cerr << "Error reading " << input << std::endl;
-        return 7;
+        std::cerr << "Error writing " << output << std::endl;
+        return 8;
       }
-      read_hashes(fin, hashes, hash2ids, text_column, id_column, format, sample,
-                  window);
     }
+    Simhash::PairWriter writer(fout.is_open() ? fout : std::cout, output_mode,
+                               distances);
+    Simhash::find_all(
+        hashes, blocks, distance,
+        [&writer](const std::vector<Simhash::match_t> &matches)
+        {
+          writer.write(matches);
+        },
+        progress_mode);
+    try
+    {
+      writer.finish();
+    }
+    catch (const std::runtime_error &e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 8;
+    }
+    status << "Found " << writer.count() << " pairs" << std::endl;
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+    std::cerr << "Total time: " << duration.count() / 1e6 << " seconds"
+              << std::endl;
+    return 0;
   }
 
   // Find matches
   std::cerr << "Computing matches..." << std::endl;
-  Simhash::clusters_t clusters =
-      Simhash::find_clusters(hashes, blocks, distance);
-
-  // Write output
-  if (output.compare("-") == 0)
+  Simhash::index_clusters_t clusters;
+  std::vector<uint64_t> labels;
+  if (!state.empty())
+  {
+    // Cluster only the new hashes against the saved state, keeping its ids
+    Simhash::ClusterState saved;
+    if (std::ifstream(state).good())
+    {
+      try
+      {
+        saved = Simhash::ClusterState::load(state);
+      }
+      catch (const std::runtime_error &e)
+      {
+        std::cerr << e.what() << std::endl;
+        return 13;
+      }
+      std::cerr << "Loaded " << saved.hashes.size() << " hashes from " << state
+                << std::endl;
+    }
+    try
+    {
+      Simhash::update_clusters(saved, hashes, blocks, distance,
+                               progress_mode);
+    }
+    catch (const std::invalid_argument &e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 13;
+    }
+    clusters = saved.clusters_of(hashes, labels);
+    std::cerr << "Writing " << saved.hashes.size() << " hashes to " << state
+              << std::endl;
+    try
+    {
+      saved.save(state);
+    }
+    catch (const std::runtime_error &e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 13;
+    }
+  }
+  else if (graph.empty())
   {
-    std::cerr << "Writing results to stdout." << std::endl;
-    write_clusters(std::cout, clusters, hash2ids);
+    clusters = Simhash::find_clusters(hashes, blocks, distance, engine,
+                                      progress_mode);
   }
   else
   {
-    std::cerr << "Writing matches to " << output << std::endl;
+    // Keep the matches as a graph, write it out, and cluster from it
+    Simhash::Graph matches =
+        Simhash::find_graph(hashes, blocks, distance, progress_mode);
+    std::cerr << "Writing " << matches.edges() << " edges to " << graph
+              << std::endl;
+    try
+    {
+      matches.save(graph, hashes);
+    }
+    catch (const std::runtime_error &e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 11;
+    }
+    clusters = Simhash::find_clusters(matches);
+  }
+
+  std::vector<Simhash::index_t> representatives;
+  if (!representative.empty())
+  {
+    std::cerr << "Choosing representatives..." << std::endl;
+    representatives = Simhash::find_representatives(clusters, hashes, offsets,
+                                                    representative_mode);
+  }
+
+  // Write output
+  status << "Found " << clusters.size() << " clusters" << std::endl;
+  try
+  {
+    if (output.compare("-") == 0)
+    {
+      std::cerr << "Writing results to stdout." << std::endl;
+      Simhash::write_clusters(std::cout, clusters, hashes, offsets, ids,
+                              labels, representatives);
+    }
+    else if (output_mode == Simhash::OutputFormat::binary)
     {
+      std::cerr << "Writing matches to " << output << std::endl;
+      Simhash::write_cluster_columns(output, clusters, hashes, offsets, ids,
+                                     labels, representatives);
+    }
+    else
+    {
+      std::cerr << "Writing matches to " << output << std::endl;
       std::ofstream fout(output, std::ofstream::binary);
       if (!fout.good())
       {
         std::cerr << "Error writing " << output << std::endl;
         return 8;
       }
-      write_clusters(fout, clusters, hash2ids);
+      Simhash::write_clusters(fout, clusters, hashes, offsets, ids, labels,
+                              representatives);
     }
   }
+  catch (const std::runtime_error &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 8;
+  }
 
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
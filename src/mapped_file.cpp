@@ -0,0 +1,72 @@
+#include "../include/mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Simhash::MappedFile::MappedFile(const std::string &path)
+    : data_(nullptr), size_(0)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    throw std::runtime_error("Error opening " + path + ": " +
+                             std::strerror(errno));
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0)
+  {
+    int error = errno;
+    ::close(fd);
+    throw std::runtime_error("Error reading " + path + ": " +
+                             std::strerror(error));
+  }
+  size_ = static_cast<size_t>(st.st_size);
+
+  // An empty file cannot be mapped, and has nothing to read anyway
+  if (size_ > 0)
+  {
+    void *address = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+      int error = errno;
+      ::close(fd);
+      throw std::runtime_error("Error mapping " + path + ": " +
+                               std::strerror(error));
+    }
+    data_ = static_cast<char *>(address);
+  }
+  ::close(fd);
+}
+
+Simhash::MappedFile::~MappedFile()
+{
+  if (data_)
+  {
+    ::munmap(data_, size_);
+  }
+}
+
+const char *Simhash::MappedFile::data() const
+{
+  return data_;
+}
+
+size_t Simhash::MappedFile::size() const
+{
+  return size_;
+}
+
+void Simhash::MappedFile::advise(int advice) const
+{
+  if (data_)
+  {
+    ::madvise(data_, size_, advice);
+  }
+}
@@ -0,0 +1,399 @@
+#include "../include/output.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include <omp.h>
+
+namespace
+{
+const char OUTPUT_MAGIC[8] = {'S', 'I', 'M', 'H', 'O', 'U', 'T', '\0'};
+const uint32_t OUTPUT_VERSION = 1;
+const uint32_t OUTPUT_BYTE_ORDER = 0x01020304;
+
+/**
+ * The fixed header of a binary cluster file, followed by the `rows` hashes,
+ * cluster ids and, if `representatives` is set, representative hashes, then
+ * `rows + 1` offsets into the `blob` bytes of ids that end the file.
+ */
+struct output_header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t rows;
+  uint64_t clusters;
+  uint64_t blob;
+  uint64_t representatives;
+};
+
+const char PAIRS_MAGIC[8] = {'S', 'I', 'M', 'H', 'P', 'R', 'S', '\0'};
+const uint32_t PAIRS_VERSION = 1;
+
+/**
+ * The fixed header of a binary pairs file, followed by `count` records of a
+ * first hash, a second hash and, if `distances` is set, their distance.
+ */
+struct pairs_header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t distances;
+  uint64_t count;
+};
+
+/**
+ * The columns of the rows of one block of clusters.
+ */
+struct columns_t
+{
+  std::vector<Simhash::hash_t> hashes;
+  std::vector<uint64_t> clusters;
+  std::vector<Simhash::hash_t> representatives;
+  std::vector<uint64_t> ends;
+  std::string blob;
+};
+
+// Cut the clusters into blocks of whole clusters with at least WRITE_BLOCK
+// rows, returning the first cluster of every block followed by the end, and
+// counting the rows.
+std::vector<size_t> cut_blocks(const Simhash::index_clusters_t &clusters,
+                               const std::vector<uint64_t> &offsets,
+                               uint64_t &total)
+{
+  std::vector<size_t> blocks(1, 0);
+  size_t rows = 0;
+  total = 0;
+  for (size_t c = 0; c < clusters.size(); ++c)
+  {
+    for (Simhash::index_t k = clusters.offsets[c];
+         k < clusters.offsets[c + 1]; ++k)
+    {
+      Simhash::index_t index = clusters.members[k];
+      rows += offsets[index + 1] - offsets[index];
+    }
+    if (rows >= Simhash::WRITE_BLOCK || c + 1 == clusters.size())
+    {
+      blocks.push_back(c + 1);
+      total += rows;
+      rows = 0;
+    }
+  }
+  return blocks;
+}
+
+// Collect the columns of the rows of the clusters [first, last).
+void collect_clusters(size_t first, size_t last,
+                      const Simhash::index_clusters_t &clusters,
+                      const std::vector<Simhash::hash_t> &hashes,
+                      const std::vector<uint64_t> &offsets,
+                      const Simhash::IdTable &ids,
+                      const std::vector<uint64_t> &labels,
+                      const std::vector<Simhash::index_t> &representatives,
+                      columns_t &out)
+{
+  out.hashes.clear();
+  out.clusters.clear();
+  out.representatives.clear();
+  out.ends.clear();
+  out.blob.clear();
+  for (size_t cluster_id = first; cluster_id < last; ++cluster_id)
+  {
+    uint64_t label = labels.empty() ? cluster_id : labels[cluster_id];
+    for (Simhash::index_t k = clusters.offsets[cluster_id];
+         k < clusters.offsets[cluster_id + 1]; ++k)
+    {
+      Simhash::index_t index = clusters.members[k];
+      for (uint64_t j = offsets[index]; j < offsets[index + 1]; ++j)
+      {
+        out.hashes.push_back(hashes[index]);
+        out.clusters.push_back(label);
+        if (!representatives.empty())
+        {
+          out.representatives.push_back(hashes[representatives[cluster_id]]);
+        }
+        ids.append_to(out.blob, j);
+        out.ends.push_back(out.blob.size());
+      }
+    }
+  }
+}
+
+template <typename T>
+void write_at(std::ostream &stream, uint64_t position,
+              const std::vector<T> &values)
+{
+  stream.seekp(position);
+  stream.write(reinterpret_cast<const char *>(values.data()),
+               values.size() * sizeof(T));
+}
+
+// Format the rows of the clusters [first, last) into `out`.
+void format_clusters(size_t first, size_t last,
+                     const Simhash::index_clusters_t &clusters,
+                     const std::vector<Simhash::hash_t> &hashes,
+                     const std::vector<uint64_t> &offsets,
+                     const Simhash::IdTable &ids,
+                     const std::vector<uint64_t> &labels,
+                     const std::vector<Simhash::index_t> &representatives,
+                     std::string &out)
+{
+  out.clear();
+  for (size_t cluster_id = first; cluster_id < last; ++cluster_id)
+  {
+    uint64_t label = labels.empty() ? cluster_id : labels[cluster_id];
+    for (Simhash::index_t k = clusters.offsets[cluster_id];
+         k < clusters.offsets[cluster_id + 1]; ++k)
+    {
+      Simhash::index_t index = clusters.members[k];
+      for (uint64_t j = offsets[index]; j < offsets[index + 1]; ++j)
+      {
+        ids.append_to(out, j);
+        out.push_back('\t');
+        Simhash::append_decimal(out, hashes[index]);
+        out.push_back('\t');
+        Simhash::append_decimal(out, label);
+        if (!representatives.empty())
+        {
+          out.push_back('\t');
+          Simhash::append_decimal(out, hashes[representatives[cluster_id]]);
+        }
+        out.push_back('\n');
+      }
+    }
+  }
+}
+} // namespace
+
+Simhash::OutputFormat Simhash::parse_output_format(const std::string &name)
+{
+  if (name == "tsv")
+  {
+    return Simhash::OutputFormat::tsv;
+  }
+  if (name == "binary")
+  {
+    return Simhash::OutputFormat::binary;
+  }
+  throw std::invalid_argument("Unknown output format: " + name);
+}
+
+void Simhash::write_clusters(
+    std::ostream &stream, const Simhash::index_clusters_t &clusters,
+    const std::vector<Simhash::hash_t> &hashes,
+    const std::vector<uint64_t> &offsets, const Simhash::IdTable &ids,
+    const std::vector<uint64_t> &labels,
+    const std::vector<Simhash::index_t> &representatives)
+{
+  stream << "id\thash\tcluster";
+  if (!representatives.empty())
+  {
+    stream << "\trepresentative";
+  }
+  stream << "\n";
+
+  uint64_t rows;
+  std::vector<size_t> blocks = cut_blocks(clusters, offsets, rows);
+
+  // Format a batch of blocks in parallel, then write them out in order
+  size_t batch = 4 * omp_get_max_threads();
+  std::vector<std::string> buffers(batch);
+  for (size_t first = 0; first + 1 < blocks.size(); first += batch)
+  {
+    size_t count = std::min(batch, blocks.size() - 1 - first);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t b = 0; b < count; ++b)
+    {
+      format_clusters(blocks[first + b], blocks[first + b + 1], clusters,
+                      hashes, offsets, ids, labels, representatives,
+                      buffers[b]);
+    }
+    for (size_t b = 0; b < count; ++b)
+    {
+      stream.write(buffers[b].data(), buffers[b].size());
+    }
+    if (!stream.good())
+    {
+      throw std::runtime_error("Error writing clusters");
+    }
+  }
+  stream.flush();
+  if (!stream.good())
+  {
+    throw std::runtime_error("Error writing clusters");
+  }
+}
+
+void Simhash::write_cluster_columns(
+    const std::string &path, const Simhash::index_clusters_t &clusters,
+    const std::vector<Simhash::hash_t> &hashes,
+    const std::vector<uint64_t> &offsets, const Simhash::IdTable &ids,
+    const std::vector<uint64_t> &labels,
+    const std::vector<Simhash::index_t> &representatives)
+{
+  std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+
+  output_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, OUTPUT_MAGIC, sizeof(OUTPUT_MAGIC));
+  header.version = OUTPUT_VERSION;
+  header.byte_order = OUTPUT_BYTE_ORDER;
+  header.clusters = clusters.size();
+  header.representatives = representatives.empty() ? 0 : 1;
+  std::vector<size_t> blocks = cut_blocks(clusters, offsets, header.rows);
+
+  // Every fixed-width column has a known place, only the blob grows
+  uint64_t column = header.rows * sizeof(uint64_t);
+  uint64_t hashes_at = sizeof(header);
+  uint64_t clusters_at = hashes_at + column;
+  uint64_t representatives_at = clusters_at + column;
+  uint64_t offsets_at = representatives_at + header.representatives * column;
+  uint64_t blob_at = offsets_at + column + sizeof(uint64_t);
+
+  std::vector<uint64_t> first_offset(1, 0);
+  write_at(out, offsets_at, first_offset);
+
+  // Collect a batch of blocks in parallel, then write each column in place
+  uint64_t row = 0;
+  size_t batch = 4 * omp_get_max_threads();
+  std::vector<columns_t> columns(batch);
+  for (size_t first = 0; first + 1 < blocks.size(); first += batch)
+  {
+    size_t count = std::min(batch, blocks.size() - 1 - first);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t b = 0; b < count; ++b)
+    {
+      collect_clusters(blocks[first + b], blocks[first + b + 1], clusters,
+                       hashes, offsets, ids, labels, representatives,
+                       columns[b]);
+    }
+    for (size_t b = 0; b < count; ++b)
+    {
+      columns_t &block = columns[b];
+      for (uint64_t &end : block.ends)
+      {
+        end += header.blob;
+      }
+      write_at(out, hashes_at + row * sizeof(uint64_t), block.hashes);
+      write_at(out, clusters_at + row * sizeof(uint64_t), block.clusters);
+      if (header.representatives)
+      {
+        write_at(out, representatives_at + row * sizeof(uint64_t),
+                 block.representatives);
+      }
+      write_at(out, offsets_at + (row + 1) * sizeof(uint64_t), block.ends);
+      out.seekp(blob_at + header.blob);
+      out.write(block.blob.data(), block.blob.size());
+      row += block.hashes.size();
+      header.blob += block.blob.size();
+    }
+    if (!out.good())
+    {
+      throw std::runtime_error("Error writing " + path);
+    }
+  }
+
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.flush();
+  if (!out.good())
+  {
+    throw std::runtime_error("Error writing " + path);
+  }
+}
+
+Simhash::PairWriter::PairWriter(std::ostream &stream,
+                                Simhash::OutputFormat format, bool distances)
+    : stream_(stream), format_(format), distances_(distances), count_(0)
+{
+  if (format_ == Simhash::OutputFormat::tsv)
+  {
+    stream_ << "first\tsecond" << (distances_ ? "\tdistance\n" : "\n");
+    return;
+  }
+
+  // The count is only known at the end, so `finish` writes it
+  pairs_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  stream_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+void Simhash::PairWriter::write(const std::vector<Simhash::match_t> &matches)
+{
+  std::string buffer;
+  if (format_ == Simhash::OutputFormat::tsv)
+  {
+    for (const Simhash::match_t &match : matches)
+    {
+      Simhash::hash_t first = match.first;
+      Simhash::hash_t second = match.second;
+      Simhash::append_decimal(buffer, first);
+      buffer.push_back('\t');
+      Simhash::append_decimal(buffer, second);
+      if (distances_)
+      {
+        buffer.push_back('\t');
+        Simhash::append_decimal(
+            buffer, static_cast<uint64_t>(
+                        Simhash::num_differing_bits(first, second)));
+      }
+      buffer.push_back('\n');
+    }
+  }
+  else
+  {
+    std::vector<uint64_t> records;
+    records.reserve(matches.size() * (distances_ ? 3 : 2));
+    for (const Simhash::match_t &match : matches)
+    {
+      Simhash::hash_t first = match.first;
+      Simhash::hash_t second = match.second;
+      records.push_back(first);
+      records.push_back(second);
+      if (distances_)
+      {
+        records.push_back(Simhash::num_differing_bits(first, second));
+      }
+    }
+    buffer.assign(reinterpret_cast<const char *>(records.data()),
+                  records.size() * sizeof(uint64_t));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  stream_.write(buffer.data(), buffer.size());
+  count_ += matches.size();
+}
+
+void Simhash::PairWriter::finish()
+{
+  if (format_ == Simhash::OutputFormat::binary)
+  {
+    pairs_header_t header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, PAIRS_MAGIC, sizeof(PAIRS_MAGIC));
+    header.version = PAIRS_VERSION;
+    header.byte_order = OUTPUT_BYTE_ORDER;
+    header.distances = distances_ ? 1 : 0;
+    header.count = count_;
+    stream_.seekp(0);
+    stream_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+  stream_.flush();
+  if (!stream_.good())
+  {
+    throw std::runtime_error("Error writing pairs");
+  }
+}
+
+uint64_t Simhash::PairWriter::count() const
+{
+  return count_;
+}
@@ -0,0 +1,135 @@
+#include "../include/progress.h"
+
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+Simhash::ProgressMode Simhash::parse_progress_mode(const std::string &name)
+{
+  if (name == "bar")
+  {
+    return Simhash::ProgressMode::bar;
+  }
+  if (name == "quiet")
+  {
+    return Simhash::ProgressMode::quiet;
+  }
+  if (name == "json")
+  {
+    return Simhash::ProgressMode::json;
+  }
+  throw std::invalid_argument("Unknown progress mode: " + name);
+}
+
+Simhash::Progress::Progress(Simhash::ProgressMode mode)
+    : mode_(mode), done_(0), total_(0), stage_(), step_(0), steps_(0),
+      drawn_(false), stop_(false),
+      start_(std::chrono::high_resolution_clock::now())
+{
+  if (mode_ != Simhash::ProgressMode::quiet)
+  {
+    thread_ = std::thread(&Simhash::Progress::run, this);
+  }
+}
+
+Simhash::Progress::~Progress()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  if (drawn_ && mode_ == Simhash::ProgressMode::bar)
+  {
+    std::cerr << "\n";
+    std::cerr.flush();
+  }
+}
+
+void Simhash::Progress::begin(const std::string &stage, size_t step,
+                              size_t steps, size_t total)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  stage_ = stage;
+  step_ = step;
+  steps_ = steps;
+  start_ = std::chrono::high_resolution_clock::now();
+  total_.store(total, std::memory_order_relaxed);
+  done_.store(0, std::memory_order_relaxed);
+}
+
+void Simhash::Progress::end()
+{
+  if (mode_ == Simhash::ProgressMode::quiet)
+  {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  done_.store(total_.load(std::memory_order_relaxed),
+              std::memory_order_relaxed);
+  report(true);
+}
+
+// Wake up a few times a second for the bar, and once a second for the
+// machine-readable output, until the reporter is destroyed.
+void Simhash::Progress::run()
+{
+  auto interval = mode_ == Simhash::ProgressMode::bar
+                      ? std::chrono::milliseconds(200)
+                      : std::chrono::milliseconds(1000);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_)
+  {
+    wake_.wait_for(lock, interval);
+    if (!stop_ && !stage_.empty())
+    {
+      report(false);
+    }
+  }
+}
+
+// Must be called with mutex_ held.
+void Simhash::Progress::report(bool final)
+{
+  size_t done = done_.load(std::memory_order_relaxed);
+  size_t total = total_.load(std::memory_order_relaxed);
+  double ratio = total ? static_cast<double>(done) / total : 1.0;
+  double seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::high_resolution_clock::now() - start_)
+                       .count() /
+                   1e6;
+
+  if (mode_ == Simhash::ProgressMode::json)
+  {
+    std::cerr << "{\"stage\":\"" << stage_ << "\",\"step\":" << step_
+              << ",\"steps\":" << steps_ << ",\"done\":" << done
+              << ",\"total\":" << total << ",\"elapsed\":" << seconds
+              << ",\"final\":" << (final ? "true" : "false") << "}\n";
+    return;
+  }
+
+  int bar_width = 70;
+  int pos = static_cast<int>(bar_width * ratio);
+
+  std::cerr << "[";
+  for (int j = 0; j < bar_width; ++j)
+  {
+    if (j < pos)
+      std::cerr << "=";
+    else if (j == pos)
+      std::cerr << ">";
+    else
+      std::cerr << " ";
+  }
+  std::cerr << "] (" << std::setw(2) << step_ << ")";
+  std::cerr << std::right << std::setw(3) << int(ratio * 100.0) << "% "
+            << std::setw(10) << int(seconds) << "/";
+  std::cerr << std::left << int(done ? seconds / ratio : 0) << " sec \r";
+  std::cerr.flush();
+  drawn_ = true;
+}
@@ -1,23 +1,18 @@
 #include "../include/simhash.h"
+#include "../include/union_find.h"
 
 #include <algorithm>
-#include <iomanip>
 #include <iostream>
-#include <list>
+#include <limits>
 #include <sstream>
 #include <thread>
 
+#include <omp.h>
+
 // Calculate the hamming distance between two hash values
 size_t Simhash::num_differing_bits(Simhash::hash_t a, Simhash::hash_t b)
 {
-  size_t count(0);
-  Simhash::hash_t n = a ^ b;
-  while (n)
-  {
-    ++count;
-    n = n & (n - 1);
-  }
-  return count;
+  return Simhash::popcount(a ^ b);
 }
 
 // Calculate the fingerprint based on the hash values
@@ -49,167 +44,620 @@ Simhash::hash_t Simhash::compute(const std::vector<Simhash::hash_t> &hashes)
   return result;
 }
 
+namespace
+{
+// Groups with more candidate pairs than this are split into several tasks so
+// that a single large group cannot serialize the scan on one thread.
+const size_t SPLIT_PAIRS = 1 << 16;
+
+// Scanned rows are published to the progress reporter in batches of this many.
+const size_t PROGRESS_ROWS = 1 << 12;
+
+// Each thread hands matches to a sink in batches of up to this many.
+const size_t SINK_BATCH = 1 << 12;
+
+/**
+ * A permuted hash together with the dense index of the hash it came from, so
+ * that matches found in permuted order can be emitted without a lookup.
+ */
+struct entry_t
+{
+  Simhash::hash_t hash;
+  Simhash::index_t index;
+};
+
+inline bool operator<(const entry_t &a, const entry_t &b)
+{
+  return a.hash < b.hash;
+}
+
+/**
+ * A unit of scanning work: compare each of the rows [first, last) against all
+ * of the hashes that follow it up to `end`, the end of its prefix group.
+ */
+struct task_t
+{
+  size_t first;
+  size_t last;
+  size_t end;
+};
+
+/**
+ * Delimit the groups of sorted hashes that share a prefix under `mask`, and
+ * turn every group with at least two members into one or more tasks.
+ *
+ * Group starts are found in parallel over contiguous slices of the input and
+ * then concatenated in order, so the resulting tasks are sorted by position.
+ */
+std::vector<task_t> make_tasks(const std::vector<entry_t> &sorted,
+                               Simhash::hash_t mask)
+{
+  size_t size = sorted.size();
+  std::vector<std::vector<size_t>> starts;
+
+#pragma omp parallel default(shared)
+  {
+#pragma omp single
+    starts.resize(omp_get_num_threads());
+
+    std::vector<size_t> &local = starts[omp_get_thread_num()];
+#pragma omp for schedule(static)
+    for (size_t i = 0; i < size; ++i)
+    {
+      if (i == 0 || (sorted[i].hash & mask) != (sorted[i - 1].hash & mask))
+      {
+        local.push_back(i);
+      }
+    }
+  }
+
+  std::vector<task_t> tasks;
+  size_t previous = size;
+  auto add_group = [&tasks](size_t first, size_t end)
+  {
+    size_t remaining = end - first;
+    size_t pairs = remaining * (remaining - 1) / 2;
+    size_t parts = (pairs + SPLIT_PAIRS - 1) / SPLIT_PAIRS;
+    size_t budget = (pairs + parts - 1) / parts;
+
+    // Row r of the group has (end - r - 1) comparisons, so cut the rows into
+    // runs of roughly `budget` comparisons each.
+    while (first + 1 < end)
+    {
+      size_t last = first, work = 0;
+      while (last + 1 < end && work < budget)
+      {
+        work += end - last - 1;
+        ++last;
+      }
+      tasks.push_back({first, last, end});
+      first = last;
+    }
+  };
+
+  for (const auto &local : starts)
+  {
+    for (size_t start : local)
+    {
+      if (previous < size && start - previous > 1)
+      {
+        add_group(previous, start);
+      }
+      previous = start;
+    }
+  }
+  if (previous < size && size - previous > 1)
+  {
+    add_group(previous, size);
+  }
+  return tasks;
+}
+
+/**
+ * The masks, in the unpermuted hash, of the leading blocks of each
+ * permutation: two hashes share a prefix under permutation `i` exactly when
+ * they agree on all bits of `leading[i]`.
+ */
+std::vector<Simhash::hash_t>
+leading_masks(const std::vector<Simhash::Permutation> &permutations,
+              size_t count)
+{
+  std::vector<Simhash::hash_t> leading;
+  for (const Simhash::Permutation &permutation : permutations)
+  {
+    Simhash::hash_t mask = 0;
+    for (size_t j = 0; j < count; ++j)
+    {
+      mask |= permutation.masks()[j];
+    }
+    leading.push_back(mask);
+  }
+  return leading;
+}
+
 /**
- * Find all near-matches in a set of hashes.
+ * Whether permutation `i` is the first under which `a` and `b` share a prefix.
+ */
+inline bool first_shared(const std::vector<Simhash::hash_t> &leading, size_t i,
+                         Simhash::hash_t a, Simhash::hash_t b)
+{
+  for (size_t j = 0; j < i; ++j)
+  {
+    if (((a ^ b) & leading[j]) == 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Find all near-matches in a collection of distinct hashes.
  *
- * This works by putting the provided hashes into a vector. Then, for each
- * permutation, apply the permutation and sort the permuted hashes. Then walk
- * the hashes, finding each unique prefix.
+ * This works by pairing every hash with its index in `hashes`. Then, for
+ * each permutation, apply the permutation and sort the permuted hashes. Then
+ * walk the hashes, finding each unique prefix.
  *
  * For each unique prefix, consider all hashes sharing that prefix, adding
  * matches with the lower number first (to avoid duplication; suppose a < b --
  * we will only emit (a, b) as a match, but (b, a) will not be emitted).
+ *
+ * The prefix groups of a permutation are delimited up front and scanned in a
+ * single parallel region with dynamic scheduling, rather than forking a team
+ * per group; large groups are split across several tasks. Progress is only
+ * counted here and reported from a separate thread.
+ *
+ * A pair may share a prefix under several permutations; it is only emitted
+ * by the first of them, so every match reaches the sink exactly once. Each
+ * match is built by `make` from the indices and hashes of its two sides, the
+ * smaller hash first.
  */
-Simhash::matches_t Simhash::find_all(
-    std::unordered_set<Simhash::hash_t> &hashes,
-    size_t number_of_blocks, size_t different_bits)
+template <typename Match, typename Make>
+void scan(const std::vector<Simhash::hash_t> &hashes, size_t number_of_blocks,
+          size_t different_bits, const Make &make,
+          const std::function<void(const std::vector<Match> &)> &sink,
+          Simhash::ProgressMode progress)
 {
-  std::vector<Simhash::hash_t> copy(hashes.begin(), hashes.end());
-  Simhash::matches_t results;
+  if (hashes.size() > std::numeric_limits<Simhash::index_t>::max())
+  {
+    throw std::invalid_argument("Too many hashes for 32-bit indices");
+  }
+
+  std::vector<entry_t> entries(hashes.size());
   auto permutations =
       Simhash::Permutation::create(number_of_blocks, different_bits);
-  std::vector<std::thread> threads;
-
-  std::mutex mt;
+  std::vector<Simhash::hash_t> leading =
+      leading_masks(permutations, number_of_blocks - different_bits);
+  Simhash::Progress reporter(progress);
 
   for (size_t i = 0; i < permutations.size(); i++)
   {
-    Simhash::Permutation &permutation = permutations[i];
-    // Apply the permutation to the set of hashes and sort
-    auto op = [permutation](Simhash::hash_t h) -> Simhash::hash_t
+    const Simhash::Permutation &permutation = permutations[i];
+
+    // Apply the permutation to the hashes, keeping their indices, and sort
+#pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < hashes.size(); ++k)
     {
-      return permutation.apply(h);
-    };
-    std::transform(hashes.begin(), hashes.end(), copy.begin(), op);
-    std::sort(copy.begin(), copy.end());
+      entries[k].hash = permutation.apply(hashes[k]);
+      entries[k].index = static_cast<Simhash::index_t>(k);
+    }
+    std::sort(entries.begin(), entries.end());
 
-    // Walk through and find regions that have the same prefix subject to the
-    // mask
-    Simhash::hash_t mask = permutation.search_mask();
+    // Find the regions that have the same prefix subject to the mask, and
+    // split them into tasks of comparable size
+    std::vector<task_t> tasks = make_tasks(entries, permutation.search_mask());
 
-    auto start = copy.begin();
-    float progress = 0;
-    int bar_width = 70;
-    auto time_start = std::chrono::high_resolution_clock::now();
-    while (start != copy.end())
+    size_t total = 0;
+    for (const task_t &task : tasks)
     {
-      std::cout << "[";
-      // Find the end of the range that starts with this prefix
-      Simhash::hash_t prefix = (*start) & mask;
-      std::vector<Simhash::hash_t>::iterator end = start;
-      for (; end != copy.end() && (*end & mask) == prefix; ++end, ++progress)
-      {
-      }
+      total += task.last - task.first;
+    }
+    reporter.begin("find_all", i, permutations.size(), total);
 
-      // For all the hashes that are between start and end, consider them all
+#pragma omp parallel default(shared)
+    {
+      std::vector<Match> local;
+      size_t rows = 0;
 
-#pragma omp parallel for default(shared)
-      for (auto a = start; a != end; ++a)
+#pragma omp for schedule(dynamic, 64) nowait
+      for (size_t t = 0; t < tasks.size(); ++t)
       {
-        for (auto b = a + 1; b != end; ++b)
+        const task_t &task = tasks[t];
+        for (size_t a = task.first; a < task.last; ++a)
         {
-          if (Simhash::num_differing_bits(*a, *b) <= different_bits)
+          for (size_t b = a + 1; b < task.end; ++b)
           {
-            Simhash::hash_t a_raw = permutation.reverse(*a);
-            Simhash::hash_t b_raw = permutation.reverse(*b);
-            // Insert the result keyed on the smaller of the two
-            mt.lock();
-            results.insert(
-                std::make_pair(std::min(a_raw, b_raw), std::max(a_raw, b_raw)));
-            mt.unlock();
+            if (Simhash::num_differing_bits(entries[a].hash, entries[b].hash) <=
+                different_bits)
+            {
+              Simhash::hash_t a_raw = permutation.reverse(entries[a].hash);
+              Simhash::hash_t b_raw = permutation.reverse(entries[b].hash);
+              if (!first_shared(leading, i, a_raw, b_raw))
+              {
+                continue;
+              }
+              // Keyed on the smaller of the two
+              local.push_back(
+                  a_raw < b_raw
+                      ? make(entries[a].index, a_raw, entries[b].index, b_raw)
+                      : make(entries[b].index, b_raw, entries[a].index, a_raw));
+              if (local.size() >= SINK_BATCH)
+              {
+                sink(local);
+                local.clear();
+              }
+            }
           }
         }
+
+        // Publish progress in batches to keep the shared counter cold
+        rows += task.last - task.first;
+        if (rows >= PROGRESS_ROWS)
+        {
+          reporter.advance(rows);
+          rows = 0;
+        }
       }
-      auto time_end = std::chrono::high_resolution_clock::now();
-      std::cout.flush();
-      int pos = bar_width * progress / hashes.size();
-      auto total = std::chrono::duration_cast<std::chrono::microseconds>(
-          time_end - time_start);
+      reporter.advance(rows);
 
-      for (int j = 0; j < bar_width; ++j)
+      if (!local.empty())
       {
-        if (j < pos)
-          std::cout << "=";
-        else if (j == pos)
-          std::cout << ">";
-        else
-          std::cout << " ";
+        sink(local);
       }
-      std::cout << "] (" << std::setw(2) << i << ")";
-      std::cout << std::right << std::setw(3)
-                << int(progress / hashes.size() * 100.0) << "% "
-                << std::setw(10) << int(total.count() / 1e6) << "/";
-      std::cout << std::left
-                << int(total.count() / progress * hashes.size() / 1e6)
-                << " sec \r";
-      std::cout.flush();
-
-      // Advance start to after the block
-      start = end;
     }
+    reporter.end();
   }
+}
 
-  for (auto &th : threads)
-  {
-    th.join();
-  }
-  std::cout << "\n";
+Simhash::match_t make_match(Simhash::index_t, Simhash::hash_t a,
+                            Simhash::index_t, Simhash::hash_t b)
+{
+  return std::make_pair(a, b);
+}
 
-  return results;
+Simhash::index_match_t make_index_match(Simhash::index_t a, Simhash::hash_t,
+                                        Simhash::index_t b, Simhash::hash_t)
+{
+  return std::make_pair(a, b);
 }
+} // namespace
 
-Simhash::clusters_t Simhash::find_clusters(
+void Simhash::find_all(std::unordered_set<Simhash::hash_t> &hashes,
+                       size_t number_of_blocks, size_t different_bits,
+                       const Simhash::match_sink_t &sink,
+                       Simhash::ProgressMode progress)
+{
+  std::vector<Simhash::hash_t> dense(hashes.begin(), hashes.end());
+  scan(dense, number_of_blocks, different_bits, make_match, sink, progress);
+}
+
+void Simhash::find_all(const std::vector<Simhash::hash_t> &hashes,
+                       size_t number_of_blocks, size_t different_bits,
+                       const Simhash::match_sink_t &sink,
+                       Simhash::ProgressMode progress)
+{
+  scan(hashes, number_of_blocks, different_bits, make_match, sink, progress);
+}
+
+void Simhash::find_all(const std::vector<Simhash::hash_t> &hashes,
+                       size_t number_of_blocks, size_t different_bits,
+                       const Simhash::index_sink_t &sink,
+                       Simhash::ProgressMode progress)
+{
+  // The indices travel with the permuted hashes, so no lookups are needed
+  scan(hashes, number_of_blocks, different_bits, make_index_match, sink,
+       progress);
+}
+
+Simhash::matches_t Simhash::find_all(
     std::unordered_set<Simhash::hash_t> &hashes,
-    size_t number_of_blocks, size_t different_bits)
+    size_t number_of_blocks, size_t different_bits,
+    Simhash::ProgressMode progress)
+{
+  Simhash::matches_t results;
+  std::mutex mutex;
+  auto collect = [&results, &mutex](const std::vector<Simhash::match_t> &batch)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    results.insert(batch.begin(), batch.end());
+  };
+  find_all(hashes, number_of_blocks, different_bits, collect, progress);
+  return results;
+}
+
+namespace
+{
+// The larger side of a join is streamed in chunks of this many hashes, each
+// permuted and sorted by the thread that takes it.
+const size_t JOIN_CHUNK = 1 << 16;
+
+/**
+ * Find all the matches between two vectors of distinct hashes, handing them
+ * to `sink` ordered as (hash from `first`, hash from `second`). Each match is
+ * built by `make` from the indices and hashes of its two sides, each index
+ * being the position in its own vector.
+ *
+ * For each permutation, the smaller side is permuted and sorted as a whole.
+ * The larger side is read in place, a chunk at a time: each chunk is
+ * permuted and sorted into a per-thread buffer and merge-joined against the
+ * table, so the cursor into the table only moves forward within a chunk.
+ * Like `scan`, a pair is only emitted by the first permutation under which
+ * it shares a prefix.
+ */
+template <typename Match, typename Make>
+void join(const std::vector<Simhash::hash_t> &first,
+          const std::vector<Simhash::hash_t> &second, size_t number_of_blocks,
+          size_t different_bits, const Make &make,
+          const std::function<void(const std::vector<Match> &)> &sink,
+          Simhash::ProgressMode progress)
 {
-  // Build up the edges of this graph
-  std::unordered_map<Simhash::hash_t, std::unordered_set<Simhash::hash_t>>
-      nodes;
-  std::unordered_map<Simhash::hash_t, bool> visited;
-  for (const auto &match : find_all(hashes, number_of_blocks, different_bits))
+  if (std::max(first.size(), second.size()) >
+      std::numeric_limits<Simhash::index_t>::max())
   {
-    nodes[match.first].insert(match.second);
-    nodes[match.second].insert(match.first);
-    visited[match.first] = false;
-    visited[match.second] = false;
+    throw std::invalid_argument("Too many hashes for 32-bit indices");
   }
 
-  // Go through every node that is connected to an edge, and conduct a BFS from
-  // it to build a cluster. Skip nodes that have already been visited.
-  Simhash::clusters_t clusters;
-  for (const auto &node : nodes)
+  bool swapped = first.size() > second.size();
+  const std::vector<Simhash::hash_t> &smaller = swapped ? second : first;
+  const std::vector<Simhash::hash_t> &larger = swapped ? first : second;
+
+  std::vector<entry_t> table(smaller.size());
+  size_t chunks = (larger.size() + JOIN_CHUNK - 1) / JOIN_CHUNK;
+  auto permutations =
+      Simhash::Permutation::create(number_of_blocks, different_bits);
+  std::vector<Simhash::hash_t> leading =
+      leading_masks(permutations, number_of_blocks - different_bits);
+  Simhash::Progress reporter(progress);
+
+  for (size_t i = 0; i < permutations.size(); i++)
   {
-    // If a node has already been visited, it's already in a cluster.
-    if (visited[node.first])
+    const Simhash::Permutation &permutation = permutations[i];
+
+    // Only the smaller side is permuted and sorted as a whole
+#pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < smaller.size(); ++k)
     {
-      continue;
+      table[k].hash = permutation.apply(smaller[k]);
+      table[k].index = static_cast<Simhash::index_t>(k);
     }
+    std::sort(table.begin(), table.end());
+    const entry_t *end = table.data() + table.size();
+    Simhash::hash_t mask = permutation.search_mask();
+    reporter.begin("find_between", i, permutations.size(), larger.size());
 
-    // If a node has not been visited, then start a cluster emanating from it.
-    visited[node.first] = true;
-    Simhash::cluster_t cluster({node.first});
-    std::list<Simhash::hash_t> frontier(node.second.begin(), node.second.end());
-    while (!frontier.empty())
+#pragma omp parallel default(shared)
     {
-      // The first frontier node is part of the cluster
-      Simhash::hash_t neighbor = frontier.front();
-      frontier.pop_front();
-      cluster.insert(neighbor);
-      visited[neighbor] = true;
-
-      // Put every unvisited neighbor in the frontier
-      for (Simhash::hash_t hash : nodes[neighbor])
+      std::vector<Match> local;
+      std::vector<entry_t> sorted;
+
+#pragma omp for schedule(dynamic, 1) nowait
+      for (size_t c = 0; c < chunks; ++c)
       {
-        if (!visited[hash])
+        size_t chunk_begin = c * JOIN_CHUNK;
+        size_t chunk_end = std::min(larger.size(), (c + 1) * JOIN_CHUNK);
+        sorted.resize(chunk_end - chunk_begin);
+        for (size_t k = chunk_begin; k < chunk_end; ++k)
         {
-          frontier.push_back(hash);
-          visited[hash] = true;
+          sorted[k - chunk_begin].hash = permutation.apply(larger[k]);
+          sorted[k - chunk_begin].index = static_cast<Simhash::index_t>(k);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        // Walk the chunk and the table together, seeking forward once per
+        // prefix
+        const entry_t *start = table.data();
+        bool positioned = false;
+        Simhash::hash_t prefix = 0;
+        for (const entry_t &streamed : sorted)
+        {
+          if (!positioned || (streamed.hash & mask) != prefix)
+          {
+            prefix = streamed.hash & mask;
+            start = std::lower_bound(
+                start, end, prefix,
+                [](const entry_t &entry, Simhash::hash_t value)
+                { return entry.hash < value; });
+            positioned = true;
+          }
+
+          Simhash::hash_t high = streamed.hash | ~mask;
+          for (const entry_t *it = start; it != end && it->hash <= high; ++it)
+          {
+            if (Simhash::num_differing_bits(it->hash, streamed.hash) >
+                different_bits)
+            {
+              continue;
+            }
+            Simhash::hash_t match_raw = permutation.reverse(it->hash);
+            Simhash::hash_t streamed_raw = permutation.reverse(streamed.hash);
+            if (!first_shared(leading, i, match_raw, streamed_raw))
+            {
+              continue;
+            }
+            local.push_back(
+                swapped
+                    ? make(streamed.index, streamed_raw, it->index, match_raw)
+                    : make(it->index, match_raw, streamed.index, streamed_raw));
+            if (local.size() >= SINK_BATCH)
+            {
+              sink(local);
+              local.clear();
+            }
+          }
         }
+        reporter.advance(sorted.size());
+      }
+
+      if (!local.empty())
+      {
+        sink(local);
       }
     }
-    clusters.push_back(cluster);
+    reporter.end();
+  }
+}
+} // namespace
+
+Simhash::matches_t Simhash::find_between(
+    const std::unordered_set<Simhash::hash_t> &first,
+    const std::unordered_set<Simhash::hash_t> &second,
+    size_t number_of_blocks, size_t different_bits,
+    Simhash::ProgressMode progress)
+{
+  Simhash::matches_t results;
+  std::mutex mutex;
+  auto collect = [&results, &mutex](const std::vector<Simhash::match_t> &batch)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    results.insert(batch.begin(), batch.end());
+  };
+
+  // Sets cannot be indexed, so only they are copied
+  std::vector<Simhash::hash_t> first_hashes(first.begin(), first.end());
+  std::vector<Simhash::hash_t> second_hashes(second.begin(), second.end());
+  join<Simhash::match_t>(first_hashes, second_hashes, number_of_blocks,
+                         different_bits, make_match, collect, progress);
+  return results;
+}
+
+void Simhash::find_between(const std::vector<Simhash::hash_t> &first,
+                           const std::vector<Simhash::hash_t> &second,
+                           size_t number_of_blocks, size_t different_bits,
+                           const Simhash::match_sink_t &sink,
+                           Simhash::ProgressMode progress)
+{
+  join(first, second, number_of_blocks, different_bits, make_match, sink,
+       progress);
+}
+
+void Simhash::find_between(const std::vector<Simhash::hash_t> &first,
+                           const std::vector<Simhash::hash_t> &second,
+                           size_t number_of_blocks, size_t different_bits,
+                           const Simhash::index_sink_t &sink,
+                           Simhash::ProgressMode progress)
+{
+  join(first, second, number_of_blocks, different_bits, make_index_match,
+       sink, progress);
+}
+
+std::vector<Simhash::index_t>
+Simhash::remap(const std::vector<Simhash::hash_t> &records,
+               std::vector<Simhash::hash_t> &hashes)
+{
+  hashes.assign(records.begin(), records.end());
+  std::sort(hashes.begin(), hashes.end());
+  hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+  if (hashes.size() > std::numeric_limits<Simhash::index_t>::max())
+  {
+    throw std::invalid_argument("Too many hashes for 32-bit indices");
+  }
+
+  std::vector<Simhash::index_t> indices(records.size());
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    indices[i] = Simhash::index_of(hashes, records[i]);
+  }
+  return indices;
+}
+
+/**
+ * Find the clusters as the connected components of the matches.
+ *
+ * Matches are merged into a concurrent union-find forest over the dense
+ * indices as soon as they are verified, so the matches themselves are never
+ * stored. Only hashes with at least one match end up in a cluster.
+ */
+Simhash::index_clusters_t Simhash::find_clusters(
+    const std::vector<Simhash::hash_t> &hashes, size_t number_of_blocks,
+    size_t different_bits, Simhash::ProgressMode progress)
+{
+  Simhash::UnionFind forest(hashes.size());
+  auto unite = [&forest](const std::vector<Simhash::index_match_t> &batch)
+  {
+    for (const Simhash::index_match_t &match : batch)
+    {
+      forest.unite(match.first, match.second);
+    }
+  };
+  find_all(hashes, number_of_blocks, different_bits, unite, progress);
+  return Simhash::make_clusters(forest);
+}
+
+Simhash::index_clusters_t Simhash::make_clusters(Simhash::UnionFind &forest)
+{
+  std::vector<Simhash::index_t> roots(forest.size());
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < roots.size(); ++i)
+  {
+    roots[i] = forest.find(static_cast<Simhash::index_t>(i));
+  }
+  return make_clusters(roots);
+}
+
+Simhash::index_clusters_t
+Simhash::make_clusters(const std::vector<Simhash::index_t> &roots)
+{
+  size_t size = roots.size();
+  const Simhash::index_t none = std::numeric_limits<Simhash::index_t>::max();
+
+  // Count the members of each set; roots are the smallest index of their set,
+  // so numbering roots in order numbers clusters by their smallest member
+  std::vector<Simhash::index_t> slots(size, 0);
+  for (size_t i = 0; i < size; ++i)
+  {
+    ++slots[roots[i]];
+  }
+
+  Simhash::index_clusters_t clusters;
+  clusters.offsets.push_back(0);
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (roots[i] != i)
+    {
+      continue;
+    }
+    if (slots[i] < 2)
+    {
+      slots[i] = none;
+      continue;
+    }
+    Simhash::index_t count = slots[i];
+    slots[i] = clusters.offsets.back();
+    clusters.offsets.push_back(clusters.offsets.back() + count);
   }
 
+  // Place every clustered index at the next slot of its cluster
+  clusters.members.resize(clusters.offsets.back());
+  for (size_t i = 0; i < size; ++i)
+  {
+    Simhash::index_t &slot = slots[roots[i]];
+    if (slot != none)
+    {
+      clusters.members[slot++] = static_cast<Simhash::index_t>(i);
+    }
+  }
+  return clusters;
+}
+
+Simhash::clusters_t Simhash::find_clusters(
+    std::unordered_set<Simhash::hash_t> &hashes,
+    size_t number_of_blocks, size_t different_bits,
+    Simhash::ProgressMode progress)
+{
+  std::vector<Simhash::hash_t> sorted(hashes.begin(), hashes.end());
+  std::sort(sorted.begin(), sorted.end());
+  Simhash::index_clusters_t found =
+      find_clusters(sorted, number_of_blocks, different_bits, progress);
+
+  Simhash::clusters_t clusters(found.size());
+  for (size_t c = 0; c < found.size(); ++c)
+  {
+    for (Simhash::index_t k = found.offsets[c]; k < found.offsets[c + 1]; ++k)
+    {
+      clusters[c].insert(sorted[found.members[k]]);
+    }
+  }
   return clusters;
 }
 
@@ -465,4 +913,9 @@ Simhash::hash_t Simhash::Permutation::reverse(hash_t hash) const
 Simhash::hash_t Simhash::Permutation::search_mask() const
 {
   return search_mask_;
-}
\ No newline at end of file
+}
+
+const std::vector<Simhash::hash_t> &Simhash::Permutation::masks() const
+{
+  return forward_masks;
+}
@@ -0,0 +1,63 @@
+#include "../include/union_find.h"
+
+#include <algorithm>
+
+Simhash::UnionFind::UnionFind(size_t size) : parent_(size)
+{
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < size; ++i)
+  {
+    parent_[i].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+  }
+}
+
+uint32_t Simhash::UnionFind::find(uint32_t x)
+{
+  while (true)
+  {
+    uint32_t parent = parent_[x].load(std::memory_order_relaxed);
+    if (parent == x)
+    {
+      return x;
+    }
+    uint32_t grandparent = parent_[parent].load(std::memory_order_relaxed);
+    if (grandparent == parent)
+    {
+      return parent;
+    }
+
+    // Path halving: point x at its grandparent, unless someone beat us to it
+    parent_[x].compare_exchange_weak(parent, grandparent,
+                                     std::memory_order_relaxed);
+    x = grandparent;
+  }
+}
+
+bool Simhash::UnionFind::unite(uint32_t a, uint32_t b)
+{
+  while (true)
+  {
+    a = find(a);
+    b = find(b);
+    if (a == b)
+    {
+      return false;
+    }
+    if (a < b)
+    {
+      std::swap(a, b);
+    }
+
+    // Link the larger root under the smaller; retry if a is no longer a root
+    uint32_t expected = a;
+    if (parent_[a].compare_exchange_strong(expected, b))
+    {
+      return true;
+    }
+  }
+}
+
+size_t Simhash::UnionFind::size() const
+{
+  return parent_.size();
+}